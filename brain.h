@@ -0,0 +1,45 @@
+/* the search engine of play.c as a library: make libbrain.a, and see the
+ * README. a state is owned by one thread at a time; different states can be
+ * searched in parallel. nothing here prints or exits. */
+#ifndef BRAIN_H
+#define BRAIN_H
+
+#include <stdint.h>
+
+/* cards are numbered 0 to 35, with color card % 6 and action card / 6 in the
+ * order of play.c. a move is hand * 37 + extra, where hand is the card that is
+ * played and extra is the +1'd or given card, the bottom card of the covered
+ * or taken pile, or 36 if there is none */
+#define BRAIN_NO_CARD 36
+#define BRAIN_MAX_MOVES 300 /* legal moves of a position */
+#define BRAIN_MAX_PILES 7  /* the easiest pile limit */
+
+/* a game with the moves made on it and the memory to search it */
+typedef struct game_state brain_state;
+
+/* a new game dealt from seed that is lost at max_piles piles on the table,
+ * from 1 to BRAIN_MAX_PILES, or NULL if max_piles is out of range or out of
+ * memory */
+brain_state *brain_new(uint64_t seed, int max_piles);
+void brain_free(brain_state *s);
+
+/* the cards in the hand of player, top first; returns their number */
+int brain_hand(const brain_state *s, int player, int *cards);
+/* the top cards of the piles on the table; returns their number */
+int brain_piles(const brain_state *s, int *tops);
+int brain_draw_pile_size(const brain_state *s);
+
+/* the legal moves of player; returns their number */
+int brain_generate_moves(brain_state *s, int player, int *moves);
+/* play a legal move of player and draw a card; returns -1 if it is not legal.
+ * its undo record is kept in s until brain_unmake_move() */
+int brain_make_move(brain_state *s, int player, int move);
+/* take back the last move made by brain_make_move() */
+void brain_unmake_move(brain_state *s);
+
+/* search for a win with player to move using at most max_nodes nodes:
+ * returns 1 with the first move of a winning line in *move, 0 if the game
+ * is lost, or -1 if the search ran out of nodes */
+int brain_search(brain_state *s, int player, uint64_t max_nodes, int *move);
+
+#endif
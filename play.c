@@ -1,22 +1,49 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-#define MAX_PILES 5
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "brain.h"
+
+#define MAX_PILES 5 /* piles at which the game is lost, see -m */
+#define PILE_LIMIT BRAIN_MAX_PILES
 #define NUM_START 5
 #define MAX_NODES_PER_SIMULATION 250
 #define TOTAL_GAMES 10
 #define TOTAL_SIMULATIONS 5000
 
+static int difficulty = MAX_PILES;
+
 /* random numbers */
 static inline uint64_t rotl(const uint64_t x, int k) {
   return (x << k) | (x >> (64 - k));
 }
 
-static uint64_t s[4] = {111, 222, 333, 444};
+/* xoshiro256++ state; every thread owns its own stream */
+typedef struct rng {
+  uint64_t s[4];
+} rng;
+
+#ifndef BRAIN_LIBRARY
+static rng game_rng = {{111, 222, 333, 444}};
+#endif
 
-uint64_t random_next(void) {
+static uint64_t random_next(rng *r) {
+  uint64_t *s = r->s;
   const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
   const uint64_t t = s[1] << 17;
   s[2] ^= s[0];
@@ -28,6 +55,28 @@ uint64_t random_next(void) {
   return result;
 }
 
+/* equivalent to 2^128 calls to random_next: non-overlapping streams */
+static void random_jump(rng *r) {
+  static const uint64_t jump[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                  0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+  uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (int i = 0; i < 4; ++i) {
+    for (int b = 0; b < 64; ++b) {
+      if (jump[i] & UINT64_C(1) << b) {
+        s0 ^= r->s[0];
+        s1 ^= r->s[1];
+        s2 ^= r->s[2];
+        s3 ^= r->s[3];
+      }
+      random_next(r);
+    }
+  }
+  r->s[0] = s0;
+  r->s[1] = s1;
+  r->s[2] = s2;
+  r->s[3] = s3;
+}
+
 enum card_color { GREEN, RED, GRAY, PURPLE, BLUE, YELLOW };
 enum card_action {
   REMOVE_TYPE,
@@ -46,14 +95,16 @@ enum card_type {
   ZOMBIE
 }; /* type = (color - action + 5) % 6 */
 
-char *card_color_esc[] = {
+static char *card_color_esc[] = {
     "\033[;42m", "\033[;41m", "\033[;100m",
     "\033[;45m", "\033[;44m", "\033[;43m",
 };
-char *card_color_str[] = {"GREEN", "RED", "GRAY", "PURPLE", "BLUE", "YELLOW"};
-char *card_action_str[] = {"REMOVE_TYPE", "REMOVE_COLOR", "COVER",
-                           "GIVE",        "TAKE",         "PLUS_ONE"};
-char *card_type_str[] = {"DRAGON", "GOOSE", "CAT", "UNICORN", "FROG", "ZOMBIE"};
+static char *card_color_str[] = {"GREEN",  "RED",  "GRAY",
+                                 "PURPLE", "BLUE", "YELLOW"};
+static char *card_action_str[] = {"REMOVE_TYPE", "REMOVE_COLOR", "COVER",
+                                  "GIVE",        "TAKE",         "PLUS_ONE"};
+static char *card_type_str[] = {"DRAGON",  "GOOSE", "CAT",
+                                "UNICORN", "FROG",  "ZOMBIE"};
 
 typedef struct card {
   struct card *right;
@@ -68,6 +119,9 @@ typedef struct card {
 
   /* 1 if taken or given */
   int visible;
+
+  /* top card of the pile if this is the bottom card of a pile on the table */
+  struct card *top;
 } card;
 
 typedef struct move {
@@ -82,25 +136,368 @@ typedef struct saved_move {
   card *extra;
 } saved_move;
 
+/* zobrist keys of a position, see init_zobrist() */
+typedef struct zobrist_key {
+  uint64_t shifted[6]; /* of the position with its colors shifted k times */
+} zobrist_key;
+
+/* what make_move() changed, to take the move back */
+typedef struct move_undo {
+  card *hand;  /* the played card */
+  card *extra; /* the +1'd or given card, or the bottom of the covered or taken
+                  pile */
+  zobrist_key key;
+  uint64_t tops, unplayed;
+  card *covered_top;      /* previous top card of covered pile */
+  card **pile_taken_hand; /* location of pile in hand */
+  card *pile_taken_top;   /* top card of the taken pile */
+  /* removed piles (type / color) and their location */
+  card *removed[6];
+  card **removed_table[6];
+  int num_removed;
+  int draw_card; /* whether a card was drawn from the pile */
+} move_undo;
+
+#define MAX_DEPTH 100 /* moves in a line of search */
+#define MAX_MOVES BRAIN_MAX_MOVES /* legal moves of a position */
+
+/* a node of a search, see search_resume() */
+typedef struct search_frame {
+  /* the move being searched; at the root, the last one searched */
+  card *hand;
+  card *extra;
+  int player;
+  int forced_move;
+  uint64_t position;   /* transposition table key */
+  int first;           /* the moves of the node start at moves[first] */
+  int legal_moves;
+  int i;               /* index of the move being searched */
+  move_undo undo;      /* of the move being searched */
+} search_frame;
+
+#ifdef SEARCH_STATS
+/* counters of play(), compiled in with -DSEARCH_STATS */
+#define STAT(x) x
+#define WIN_INDEX_BINS 16
+
+typedef struct search_stats {
+  uint64_t nodes_at_depth[100];
+  uint64_t expanded;    /* nodes where moves were generated */
+  uint64_t legal_moves; /* moves generated at those nodes */
+  uint64_t tt_hits;
+  uint64_t tablebase_hits;
+  uint64_t winnable_cutoffs;
+  uint64_t stuck_cutoffs; /* every move reaches the pile limit */
+  uint64_t pile_cutoffs;
+  uint64_t budget_cutoffs;
+  /* index of the first winning move in best-first order, the last bin
+   * counts larger indices */
+  uint64_t win_index[WIN_INDEX_BINS];
+  uint64_t win_index_sum;
+} search_stats;
+static void count_win_index(search_stats *t, int i) {
+  ++t->win_index[i < WIN_INDEX_BINS - 1 ? i : WIN_INDEX_BINS - 1];
+  t->win_index_sum += i;
+}
+
+static void clear_search_stats(search_stats *t) {
+  for (int i = 0; i < 100; ++i)
+    t->nodes_at_depth[i] = 0;
+  t->expanded = 0;
+  t->legal_moves = 0;
+  t->tt_hits = 0;
+  t->tablebase_hits = 0;
+  t->winnable_cutoffs = 0;
+  t->stuck_cutoffs = 0;
+  t->pile_cutoffs = 0;
+  t->budget_cutoffs = 0;
+  for (int i = 0; i < WIN_INDEX_BINS; ++i)
+    t->win_index[i] = 0;
+  t->win_index_sum = 0;
+}
+
+static void add_search_stats(search_stats *dst, search_stats *src) {
+  for (int i = 0; i < 100; ++i)
+    dst->nodes_at_depth[i] += src->nodes_at_depth[i];
+  dst->expanded += src->expanded;
+  dst->legal_moves += src->legal_moves;
+  dst->tt_hits += src->tt_hits;
+  dst->tablebase_hits += src->tablebase_hits;
+  dst->winnable_cutoffs += src->winnable_cutoffs;
+  dst->stuck_cutoffs += src->stuck_cutoffs;
+  dst->pile_cutoffs += src->pile_cutoffs;
+  dst->budget_cutoffs += src->budget_cutoffs;
+  for (int i = 0; i < WIN_INDEX_BINS; ++i)
+    dst->win_index[i] += src->win_index[i];
+  dst->win_index_sum += src->win_index_sum;
+}
+
+/* one line of json, with the game and turn if not negative */
+static void print_search_stats(FILE *stream, int game, int turn,
+                               search_stats *t) {
+  uint64_t nodes = 0, wins = 0;
+  int depth = 0;
+  for (int i = 0; i < 100; ++i) {
+    nodes += t->nodes_at_depth[i];
+    if (t->nodes_at_depth[i])
+      depth = i + 1;
+  }
+  for (int i = 0; i < WIN_INDEX_BINS; ++i)
+    wins += t->win_index[i];
+
+  fprintf(stream, "{\"game\":%d,", game);
+  if (turn >= 0)
+    fprintf(stream, "\"turn\":%d,", turn);
+  fprintf(stream, "\"nodes\":%" PRIu64 ",\"nodes_per_depth\":[", nodes);
+  for (int i = 0; i < depth; ++i)
+    fprintf(stream, "%s%" PRIu64, i ? "," : "", t->nodes_at_depth[i]);
+  fprintf(stream,
+          "],\"expanded\":%" PRIu64 ",\"branching\":%.3f,"
+          "\"tt_hits\":%" PRIu64 ",\"tablebase_hits\":%" PRIu64
+          ",\"winnable_cutoffs\":%" PRIu64 ",\"stuck_cutoffs\":%" PRIu64
+          ",\"pile_cutoffs\":%" PRIu64 ",\"budget_cutoffs\":%" PRIu64
+          ",\"wins\":%" PRIu64 ",\"win_index_mean\":%.3f,\"win_index\":[",
+          t->expanded, t->expanded ? (double)t->legal_moves / t->expanded : 0,
+          t->tt_hits, t->tablebase_hits, t->winnable_cutoffs, t->stuck_cutoffs,
+          t->pile_cutoffs, t->budget_cutoffs, wins,
+          wins ? (double)t->win_index_sum / wins : 0);
+  for (int i = 0; i < WIN_INDEX_BINS; ++i)
+    fprintf(stream, "%s%" PRIu64, i ? "," : "", t->win_index[i]);
+  fprintf(stream, "]}\n");
+}
+#else
+#define STAT(x)
+#endif
+
 typedef struct game_state {
   card cards[36];
   uint8_t draw_pile_size;
   card *hands[2];
   card *table;
   card *pile[36];
-  saved_move stack[100];
+  search_frame stack[MAX_DEPTH];     /* nodes of the search */
+  /* moves of the nodes of the search, after those of brain_make_move() */
+  move moves[MAX_DEPTH * MAX_MOVES + MAX_DEPTH];
   uint64_t nodes;
   int depth;
+  int root_depth; /* depth at which the search started */
+  uint8_t min_draw_pile_size; /* draw pile size the search depends on */
 
   int cards_left;                /* number of non-discarded cards */
-  uint8_t left_of_color_type[6]; /* bool matrix[i, j] where i in bytes is color,
-                                    j in bits is type */
+  uint64_t left;                 /* non-discarded cards */
   int pile_count;                /* number of piles on the table */
+  int max_piles;                 /* the game is lost at this many piles */
   int count_cover;               /* number of non-discarded cover cards */
+  uint64_t tops;                 /* top cards of the piles on the table */
+  uint64_t unplayed;             /* cards in the hands and the draw pile */
   uint8_t can_remove_color;      /* whether removal of color is not discarded */
   uint8_t can_remove_type;       /* whether removal of type is not discarded */
+
+  zobrist_key key; /* zobrist keys of hands, table and draw pile */
+  uint64_t *tt; /* transposition table of proven results, or NULL */
+  uint64_t *proven; /* results kept across turns, see proven_store() */
+  int *cancel;  /* search returns unknown once this is set, or NULL */
+  double deadline; /* search returns unknown after this time, or 0 */
+
+#ifdef SEARCH_STATS
+  search_stats stats;
+#endif
 } game_state;
 
+/* zobrist keys. a pile with bottom card b is hashed as pile[c][b] for every
+ * card c on it plus top[t] for its top card t, so neither the order of the
+ * piles nor of the covered cards matters. the draw pile and the pile limit
+ * are part of the key, so that results stay valid across determinizations and
+ * difficulties.
+ *
+ * shifting all colors by one, and with them the types, maps the deck onto
+ * itself with the same rules, so positions come in classes of six that are
+ * won or lost alike. the cards have independent random keys, entry k of a
+ * table holds the key of its card shifted k times, so that a position keeps
+ * the keys of all six of its shifts, and the transposition table uses the
+ * smallest of them. swapping the players is a symmetry too, but is left out:
+ * positions that only differ by it hardly ever meet in a search. */
+static zobrist_key zobrist_hand[2][36];
+static zobrist_key zobrist_pile[36][36];
+static zobrist_key zobrist_top[36];
+static zobrist_key zobrist_draw[36][36];
+static uint64_t zobrist_player;
+static zobrist_key zobrist_max_piles[PILE_LIMIT + 1];
+
+static uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+static inline void xor_key(zobrist_key *key, const zobrist_key *z) {
+  for (int k = 0; k < 6; ++k)
+    key->shifted[k] ^= z->shifted[k];
+}
+
+/* the same key for all six color shifts of a position */
+static inline uint64_t canonical_key(const zobrist_key *key) {
+  uint64_t min = key->shifted[0];
+  for (int k = 1; k < 6; ++k)
+    if (key->shifted[k] < min)
+      min = key->shifted[k];
+  return min;
+}
+
+/* card i with its color shifted by one */
+static inline int shift_card(int i) { return i - i % 6 + (i + 1) % 6; }
+
+static void init_zobrist(void) {
+  uint64_t x = 0;
+  uint64_t hand[2][36], pile[36][36], top[36], draw[36][36];
+  for (int c = 0; c < 36; ++c) {
+    hand[0][c] = splitmix64(&x);
+    hand[1][c] = splitmix64(&x);
+    top[c] = splitmix64(&x);
+    for (int j = 0; j < 36; ++j) {
+      pile[j][c] = splitmix64(&x);
+      draw[j][c] = splitmix64(&x);
+    }
+  }
+  /* shift[c] is card c shifted k times */
+  int shift[36];
+  for (int c = 0; c < 36; ++c)
+    shift[c] = c;
+  for (int k = 0; k < 6; ++k) {
+    for (int c = 0; c < 36; ++c) {
+      zobrist_hand[0][c].shifted[k] = hand[0][shift[c]];
+      zobrist_hand[1][c].shifted[k] = hand[1][shift[c]];
+      zobrist_top[c].shifted[k] = top[shift[c]];
+      for (int j = 0; j < 36; ++j) {
+        zobrist_pile[j][c].shifted[k] = pile[shift[j]][shift[c]];
+        zobrist_draw[j][c].shifted[k] = draw[j][shift[c]];
+      }
+    }
+    for (int c = 0; c < 36; ++c)
+      shift[c] = shift_card(shift[c]);
+  }
+  zobrist_player = splitmix64(&x);
+  /* the same in all six, so that shifts keep it */
+  for (int i = 0; i <= PILE_LIMIT; ++i) {
+    uint64_t r = splitmix64(&x);
+    for (int k = 0; k < 6; ++k)
+      zobrist_max_piles[i].shifted[k] = r;
+  }
+}
+
+/* xor the keys of the pile with bottom card p into key */
+static void xor_pile_key(game_state *s, card *p, zobrist_key *key) {
+  card *q = p;
+  for (;; q = q->down) {
+    xor_key(key, &zobrist_pile[q - s->cards][p - s->cards]);
+    if (!q->down)
+      break;
+  }
+  xor_key(key, &zobrist_top[q - s->cards]);
+}
+
+static zobrist_key state_key(game_state *s) {
+  zobrist_key key = zobrist_max_piles[s->max_piles];
+  for (int player = 0; player < 2; ++player)
+    for (card *c = s->hands[player]; c; c = c->down)
+      xor_key(&key, &zobrist_hand[player][c - s->cards]);
+  for (card *p = s->table; p; p = p->right)
+    xor_pile_key(s, p, &key);
+  for (int i = 0; i < s->draw_pile_size; ++i)
+    xor_key(&key, &zobrist_draw[i][s->pile[i] - s->cards]);
+  return key;
+}
+
+/* transposition table: an entry is the key with the result + 1 in its lowest
+ * two bits, or 0 if empty. always replaces. */
+#define TT_BITS 20
+
+static uint64_t *tt_alloc(void) {
+  uint64_t *tt = calloc(UINT64_C(1) << TT_BITS, sizeof(uint64_t));
+  if (tt == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return tt;
+}
+
+static int tt_probe(uint64_t *tt, uint64_t key) {
+  uint64_t e = tt[key & ((UINT64_C(1) << TT_BITS) - 1)];
+  if ((e & 3) == 0 || ((e ^ key) & ~UINT64_C(3)) != 0)
+    return -1;
+  return (e & 3) - 1;
+}
+
+static void tt_store(uint64_t *tt, uint64_t key, int result) {
+  tt[key & ((UINT64_C(1) << TT_BITS) - 1)] =
+      (key & ~UINT64_C(3)) | (uint64_t)(result + 1);
+}
+
+/* proven results that later turns start from: the positions one move after
+ * the root of a search that it proved, and the positions on the line of a win
+ * with the winning move. a table of tt_alloc() is shared by the searches of an
+ * agent, so the key is not the canonical one, which would lose the colors of
+ * the move. an entry is a word of the key, the move index + 1 of a win or 0
+ * for a loss, and a valid bit */
+static void proven_store(uint64_t *t, uint64_t key, int won, int move_idx) {
+  __atomic_store_n(&t[key & ((UINT64_C(1) << TT_BITS) - 1)],
+                   (key & ~UINT64_C(0xfff)) |
+                       (uint64_t)(won ? move_idx + 1 : 0) << 1 | 1,
+                   __ATOMIC_RELAXED);
+}
+
+/* 1 with the winning move in *move_idx, 0, or -1 if not known */
+static int proven_probe(uint64_t *t, uint64_t key, int *move_idx) {
+  uint64_t e = __atomic_load_n(&t[key & ((UINT64_C(1) << TT_BITS) - 1)],
+                               __ATOMIC_RELAXED);
+  if ((e & 1) == 0 || ((e ^ key) & ~UINT64_C(0xfff)) != 0)
+    return -1;
+  *move_idx = (int)(e >> 1 & 0x7ff) - 1;
+  return *move_idx >= 0;
+}
+
+/* endgame tablebase given with -T, see -E: the sorted keys, as enter_node()
+ * computes them, of the lost positions with at most tablebase_cards cards
+ * left and a pile limit of tablebase_piles. the table holds every lost one,
+ * so such a position that passes the checks before the probe and is not in
+ * it is won */
+static const uint64_t *tablebase = NULL;
+static uint64_t tablebase_entries = 0;
+static int tablebase_cards = 0;
+static int tablebase_piles = 0;
+
+static int tablebase_lost(uint64_t key) {
+  uint64_t lo = 0, hi = tablebase_entries;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (tablebase[mid] < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < tablebase_entries && tablebase[lo] == key;
+}
+
+/* cards of a color and of a type as masks of card indices */
+static const uint64_t color_cards[6] = {
+    0x041041041, 0x082082082, 0x104104104,
+    0x208208208, 0x410410410, 0x820820820,
+};
+static const uint64_t type_cards[6] = {
+    0x810204081, 0x060408102, 0x081810204,
+    0x102060408, 0x204081810, 0x408102060,
+};
+
+/* top cards of the piles that card c removes */
+static inline uint64_t cleared_tops(game_state *s, card *c) {
+  if (c->action == REMOVE_COLOR)
+    return s->tops & color_cards[c->remove_color];
+  if (c->action == REMOVE_TYPE)
+    return s->tops & type_cards[c->remove_type];
+  return 0;
+}
+
 static void remove_card(game_state *s, card *c) {
   switch (c->action) {
   case COVER:
@@ -116,7 +513,7 @@ static void remove_card(game_state *s, card *c) {
     break;
   }
 
-  s->left_of_color_type[c->color] ^= 1 << c->type;
+  s->left ^= UINT64_C(1) << (c - s->cards);
   --s->cards_left;
 }
 
@@ -135,7 +532,7 @@ static void add_card(game_state *s, card *c) {
     break;
   }
 
-  s->left_of_color_type[c->color] ^= 1 << c->type;
+  s->left ^= UINT64_C(1) << (c - s->cards);
   ++s->cards_left;
 }
 
@@ -152,15 +549,159 @@ static void print_card(FILE *stream, card *p, int show_open) {
     fprintf(stream, " [visible]");
 }
 
+/* cards removed by the removal cards of a mask of colors or types */
+static const uint64_t color_removal[64] = {
+    0x000000000, 0x041041041, 0x082082082, 0x0c30c30c3,
+    0x104104104, 0x145145145, 0x186186186, 0x1c71c71c7,
+    0x208208208, 0x249249249, 0x28a28a28a, 0x2cb2cb2cb,
+    0x30c30c30c, 0x34d34d34d, 0x38e38e38e, 0x3cf3cf3cf,
+    0x410410410, 0x451451451, 0x492492492, 0x4d34d34d3,
+    0x514514514, 0x555555555, 0x596596596, 0x5d75d75d7,
+    0x618618618, 0x659659659, 0x69a69a69a, 0x6db6db6db,
+    0x71c71c71c, 0x75d75d75d, 0x79e79e79e, 0x7df7df7df,
+    0x820820820, 0x861861861, 0x8a28a28a2, 0x8e38e38e3,
+    0x924924924, 0x965965965, 0x9a69a69a6, 0x9e79e79e7,
+    0xa28a28a28, 0xa69a69a69, 0xaaaaaaaaa, 0xaebaebaeb,
+    0xb2cb2cb2c, 0xb6db6db6d, 0xbaebaebae, 0xbefbefbef,
+    0xc30c30c30, 0xc71c71c71, 0xcb2cb2cb2, 0xcf3cf3cf3,
+    0xd34d34d34, 0xd75d75d75, 0xdb6db6db6, 0xdf7df7df7,
+    0xe38e38e38, 0xe79e79e79, 0xebaebaeba, 0xefbefbefb,
+    0xf3cf3cf3c, 0xf7df7df7d, 0xfbefbefbe, 0xfffffffff,
+};
+static const uint64_t type_removal[64] = {
+    0x000000000, 0x810204081, 0x060408102, 0x87060c183,
+    0x081810204, 0x891a14285, 0x0e1c18306, 0x8f1e1c387,
+    0x102060408, 0x912264489, 0x16246850a, 0x97266c58b,
+    0x18387060c, 0x993a7468d, 0x1e3c7870e, 0x9f3e7c78f,
+    0x204081810, 0xa14285891, 0x264489912, 0xa7468d993,
+    0x285891a14, 0xa95a95a95, 0x2e5c99b16, 0xaf5e9db97,
+    0x3060e1c18, 0xb162e5c99, 0x3664e9d1a, 0xb766edd9b,
+    0x3878f1e1c, 0xb97af5e9d, 0x3e7cf9f1e, 0xbf7efdf9f,
+    0x408102060, 0xc183060e1, 0x46850a162, 0xc7870e1e3,
+    0x489912264, 0xc99b162e5, 0x4e9d1a366, 0xcf9f1e3e7,
+    0x50a162468, 0xd1a3664e9, 0x56a56a56a, 0xd7a76e5eb,
+    0x58b97266c, 0xd9bb766ed, 0x5ebd7a76e, 0xdfbf7e7ef,
+    0x60c183870, 0xe1c3878f1, 0x66c58b972, 0xe7c78f9f3,
+    0x68d993a74, 0xe9db97af5, 0x6edd9bb76, 0xefdf9fbf7,
+    0x70e1e3c78, 0xf1e3e7cf9, 0x76e5ebd7a, 0xf7e7efdfb,
+    0x78f9f3e7c, 0xf9fbf7efd, 0x7efdfbf7e, 0xfffffffff,
+};
+
+#define TAKE_CARDS UINT64_C(0x03f000000)
+
+/* targets of the removal of type cards 0-5 and of color cards 6-11 in a mask
+ * of card indices */
+static inline int type_targets(uint64_t cards) {
+  int m = cards & 0x3f;
+  return ((m >> 1) | (m << 5)) & 0x3f;
+}
+static inline int color_targets(uint64_t cards) {
+  int m = (cards >> 6) & 0x3f;
+  return ((m << 1) | (m >> 5)) & 0x3f;
+}
+
+/* whether the piles can end up below the limit. the cards that no removal
+ * card can clear stay on the table, except one per cover card that hides or
+ * takes down another one. a removal card that was played only acts again once
+ * it is taken back, which needs a take card that is still to be played. */
+static inline uint64_t removable_cards(uint64_t left, uint64_t unplayed,
+                                       int colors, int types) {
+  if ((unplayed & TAKE_CARDS) == 0) {
+    types = type_targets(unplayed);
+    colors = color_targets(unplayed);
+  }
+  return left & (color_removal[colors] | type_removal[types]);
+}
+
 static int winnable(game_state *s) {
-  int x = 0;
-  for (int color = 0; color < 6; ++color) {
-    char bit = (-((s->can_remove_color >> color) & 1)) | s->can_remove_type;
-    x += __builtin_popcount(bit & s->left_of_color_type[color]);
+  int x = __builtin_popcountll(removable_cards(
+      s->left, s->unplayed, s->can_remove_color, s->can_remove_type));
+  return s->cards_left - x - s->count_cover < s->max_piles;
+}
+
+/* whether searches with a budget of at least REDUCE_MIN_NODES skip moves that
+ * are equivalent to earlier ones. the short searches of the simulations gain
+ * too little to pay for finding them */
+#define REDUCE_MIN_NODES 10000
+static int reduce_moves = 1;
+
+/* a card that no removal card can clear any more only matters by its action,
+ * so two such cards with the same action are interchangeable for the rest of
+ * the game, and so are such removal cards whose target has no cards left. */
+static inline uint64_t interchangeable_cards(uint64_t left,
+                                             uint64_t removable) {
+  uint64_t same = left & ~removable;
+  if ((same & 0xfff) == 0)
+    return same;
+  /* drop the removal cards with cards left to remove */
+  for (int i = 0; i < 6; ++i) {
+    if (left & color_cards[i])
+      same &= ~(UINT64_C(1) << (6 + (i + 5) % 6));
+    if (left & type_cards[i])
+      same &= ~(UINT64_C(1) << (i + 1) % 6);
+  }
+  return same;
+}
+
+/* the action as the class of card i, REMOVE_TYPE for removal cards without
+ * targets, or -1 if the card has no equivalent */
+static inline int card_class(uint64_t interchangeable, int i) {
+  if (((interchangeable >> i) & 1) == 0)
+    return -1;
+  return i / 6 == REMOVE_COLOR ? REMOVE_TYPE : i / 6;
+}
+
+/* the classes of the cards of a pile bottom first, 3 bits each, or -1 if a
+ * card has no equivalent. piles with the same classes are interchangeable. */
+static inline int64_t pile_class(game_state *s, card *bottom,
+                                 uint64_t interchangeable) {
+  int64_t sig = 1;
+  for (card *c = bottom; c; c = c->down) {
+    int k = card_class(interchangeable, c - s->cards);
+    if (k < 0)
+      return -1;
+    sig = sig << 3 | k;
+  }
+  return sig;
+}
+
+/* whether player has a move that stays below the pile limit */
+static int can_move(game_state *s, int player) {
+  int piles_left = s->max_piles - s->pile_count;
+  if (piles_left > 2)
+    return 1;
+
+  for (card *c = s->hands[player]; c; c = c->down) {
+    switch (c->action) {
+    case COVER:
+      if (s->table || piles_left > 1)
+        return 1;
+      break;
+    case TAKE:
+      if (piles_left > 1)
+        return 1;
+      /* a pile with a take card cannot be taken */
+      for (card *p = s->table; p; p = p->right)
+        if (p->action != TAKE)
+          return 1;
+      break;
+    case GIVE:
+      if (piles_left > 1)
+        return 1;
+      break;
+    case PLUS_ONE:
+      /* two piles, or one if it is the last card */
+      if (piles_left > 1 && s->hands[player] == c && c->down == NULL)
+        return 1;
+      break;
+    default:
+      if (piles_left > 1 || cleared_tops(s, c))
+        return 1;
+      break;
+    }
   }
 
-  /* every cover card can remove at best one other card */
-  return s->cards_left - x - s->count_cover < MAX_PILES;
+  return 0;
 }
 
 static void indent(FILE *stream, int depth) {
@@ -182,8 +723,8 @@ static void print_state(FILE *stream, game_state *s, int depth) {
     fprintf(stream, "%s%-10s", (s->can_remove_type >> type) & 1 ? "*" : " ",
             card_type_str[type]);
     for (int color = 0; color < 6; ++color) {
-      fprintf(stream, "%d          ",
-              (s->left_of_color_type[color] >> type) & 1);
+      int i = (color - type + 6) % 6 * 6 + color;
+      fprintf(stream, "%d          ", (int)((s->left >> i) & 1));
     }
     fprintf(stream, "\n");
   }
@@ -220,83 +761,53 @@ static void print_state(FILE *stream, game_state *s, int depth) {
   }
 }
 
-static int verbose = 0;
-
-static int play(game_state *s, int player, int static_check, uint64_t max_nodes,
-                int forced_move) {
-  ++s->nodes;
-
-  if (verbose) {
-    indent(stderr, s->depth);
-    fprintf(stderr, "nodes: %" PRIu64 ". depth = %d\n", s->nodes, s->depth);
-    print_state(stderr, s, s->depth);
-    fprintf(stderr, "\n");
-    fflush(stderr);
-  }
-
-  if (s->pile_count >= MAX_PILES)
-    return 0;
-
-  /* no cards to play, skip to next player */
-  if (s->hands[player] == NULL)
-    player = !player;
-
-  /* both players are done, game is won */
-  if (s->hands[player] == NULL) {
-    if (verbose) {
-      fprintf(stdout, "[%d] ", s->depth);
-      print_state(stdout, s, 0);
-      fprintf(stdout, "\n");
-      fflush(stdout);
-    }
-    return 1;
-  }
-
-  if (s->nodes >= max_nodes)
-    return -1;
+/* generate all moves of player into moves and return their number; if reduce
+ * is set, only one of every set of equivalent moves */
+static int generate_moves(game_state *s, int player, move *moves,
+                          int reduce) {
+  int legal_moves = 0;
 
   int cards_in_hand = 0;
   for (card *h = s->hands[player]; h; h = h->down)
     ++cards_in_hand;
 
-  int other = !player;
-
-  move moves[300];
-  int legal_moves = 0;
-
-  /* check if too few removal cards remain to win */
-  if (static_check && !winnable(s))
-    return 0;
-
-  /* count what's removable on table */
-  int color_count[6] = {0};
-  int type_count[6] = {0};
-  for (card *x = s->table; x; x = x->right) {
-    card *y = x;
-    while (y->down)
-      y = y->down;
-    ++color_count[y->color];
-    ++type_count[y->type];
+  /* only play the first card of each class, see card_class() */
+  uint64_t same = 0, same_piles = 0;
+  if (reduce && reduce_moves) {
+    same = interchangeable_cards(
+        s->left, removable_cards(s->left, s->unplayed, s->can_remove_color,
+                                 s->can_remove_type));
+    /* piles are only interchangeable if their tops are */
+    uint64_t t = same & s->tops, u = same & s->unplayed;
+    if (t & (t - 1))
+      same_piles = same;
+    if ((u & (u - 1)) == 0)
+      same = 0;
   }
+  int played_classes = 0;
 
-  /* generate all moves */
   int hand_idx = 0;
-  int piles_left = MAX_PILES - s->pile_count;
+  int piles_left = s->max_piles - s->pile_count;
   for (card **h = &s->hands[player]; *h; h = &(*h)->down, ++hand_idx) {
     card *c = *h;
     /* avoid creating more piles than allowed */
     if (c->action == GIVE && piles_left <= 0)
       continue;
-    else if (c->action == REMOVE_COLOR && piles_left <= 0 &&
-             color_count[c->remove_color] == 0)
-      continue;
-    else if (c->action == REMOVE_TYPE && piles_left <= 0 &&
-             type_count[c->remove_type] == 0)
+    else if ((c->action == REMOVE_COLOR || c->action == REMOVE_TYPE) &&
+             piles_left <= 0 && cleared_tops(s, c) == 0)
       continue;
     else if (c->action == PLUS_ONE &&
              piles_left <= (cards_in_hand == 1 ? 1 : 2))
       continue;
 
+    if (same) {
+      int k = card_class(same, c - s->cards);
+      if (k >= 0 && (played_classes >> k & 1))
+        continue;
+      if (k >= 0)
+        played_classes |= 1 << k;
+    }
+
     /* generate cards to play extra */
     if (c->action == GIVE || c->action == PLUS_ONE) {
       /* temporarily remove current card from hand */
@@ -305,13 +816,20 @@ static int play(game_state *s, int player, int static_check, uint64_t max_nodes,
 
       int extra_idx = 0;
 
-      int pairs = 0;
+      int pairs = 0, extra_classes = 0;
       for (card **e = &s->hands[player]; *e; e = &(*e)->down, ++extra_idx) {
         ++pairs;
         /* only enqueue (A, B), (B, A) once if A == B on PLUS_ONE actions  */
         if (c->action == PLUS_ONE && (*e)->action == PLUS_ONE &&
             extra_idx < hand_idx)
           continue;
+        if (same) {
+          int k = card_class(same, *e - s->cards);
+          if (k >= 0 && (extra_classes >> k & 1))
+            continue;
+          if (k >= 0)
+            extra_classes |= 1 << k;
+        }
         move *m = &moves[legal_moves++];
         m->hand = h;
         m->extra = e;
@@ -326,18 +844,29 @@ static int play(game_state *s, int player, int static_check, uint64_t max_nodes,
       *h = tmp;
 
     } else if (c->action == COVER || c->action == TAKE) {
-      int pairs = 0;
+      int pairs = 0, seen = 0;
+      int64_t seen_piles[PILE_LIMIT];
       for (card **e = &s->table; *e; e = &(*e)->right) {
         /* cannot take a pile with take back card */
         if (c->action == TAKE && (*e)->action == TAKE)
           continue;
+        ++pairs;
+        if (same_piles) {
+          int64_t k = pile_class(s, *e, same_piles);
+          int i = 0;
+          while (k >= 0 && i < seen && seen_piles[i] != k)
+            ++i;
+          if (k >= 0 && i < seen)
+            continue;
+          if (k >= 0)
+            seen_piles[seen++] = k;
+        }
         move *m = &moves[legal_moves++];
         m->hand = h;
         m->extra = e;
-        ++pairs;
       }
       /* the card cannot be played with an extra */
-      if (pairs == 0 && s->pile_count < MAX_PILES - 1) {
+      if (pairs == 0 && s->pile_count < s->max_piles - 1) {
         move *m = &moves[legal_moves++];
         m->hand = h;
         m->extra = NULL;
@@ -350,265 +879,972 @@ static int play(game_state *s, int player, int static_check, uint64_t max_nodes,
     }
   }
 
-  if (forced_move >= 0) {
-    /* force the dictated move */
-    if (legal_moves > 0) {
-      moves[0] = moves[forced_move % legal_moves];
-      legal_moves = 1;
-    }
-  } else {
-    /* reorder moves best-first */
-    for (int good = 0, bad = legal_moves - 1, i = 0; i < bad;) {
-      /* move +1 with +1 to front, move cards that remove >= 2 to front, move
-       * take removal cards to front */
-      move m = moves[i];
-      enum card_action action = (*m.hand)->action;
-      if ((action == PLUS_ONE && m.extra &&
-           (m.hand == m.extra ? (*m.hand)->down : *m.extra)->action ==
-               PLUS_ONE) ||
-          (action == REMOVE_TYPE && type_count[(*m.hand)->remove_type] >= 2) ||
-          (action == REMOVE_COLOR &&
-           color_count[(*m.hand)->remove_color] >= 2) ||
-          (action == TAKE && m.extra &&
-           ((*m.extra)->action == REMOVE_TYPE ||
-            (*m.extra)->action == REMOVE_COLOR))) {
-        moves[i] = moves[good];
-        moves[good] = m;
-        ++good;
-        ++i;
-      }
-      /* move take back +1 to back, move remove nothing to back */
-      else if ((action == TAKE && m.extra && (*m.extra)->action == PLUS_ONE) ||
-               (action == REMOVE_TYPE &&
-                type_count[(*m.hand)->remove_type] == 0) ||
-               (action == REMOVE_COLOR &&
-                color_count[(*m.hand)->remove_color] == 0)) {
-        moves[i] = moves[bad];
-        moves[bad] = m;
-        --bad;
-      } else {
-        ++i;
-      }
-    }
-  }
+  return legal_moves;
+}
 
-  int won = 0;
+/* index of the move as hand * 37 + (extra or 36) */
+static int move_to_idx(game_state *s, move m) {
+  card *c = *m.hand;
+  if (!m.extra)
+    return (c - s->cards) * 37 + 36;
+  card *extra = m.hand == m.extra ? c->down : *m.extra;
+  return (c - s->cards) * 37 + (extra - s->cards);
+}
 
-  /* iterate over all moves in hand */
-  for (int i = 0; i < legal_moves; ++i) {
+/* reorder moves best-first */
+static void order_moves(game_state *s, move *moves, int legal_moves) {
+  for (int good = 0, bad = legal_moves - 1, i = 0; i < bad;) {
+    /* move +1 with +1 to front, move cards that remove >= 2 to front, move
+     * take removal cards to front */
     move m = moves[i];
-    card *c = *m.hand;
-
-    s->stack[s->depth].hand = c;
-
-    /* remove from hand */
-    *m.hand = c->down;
-    c->down = NULL;
-
-    s->stack[s->depth].extra = m.extra ? *m.extra : NULL;
-
-    card **covered_card = NULL;    /* covered card's down pointer */
-    card **pile_taken_hand = NULL; /* location of pile in hand */
-
-    /* removed piles (type / color) and their location */
-    card *removed[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
-    card **removed_table[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
-    int num_removed = 0;
-
-    if (c->action == REMOVE_COLOR || c->action == REMOVE_TYPE) {
-      /* remove other piles with same color or type */
-      for (card **p = &s->table; *p;) {
-        card *q = *p;
-        while (q->down)
-          q = q->down;
-        if ((c->action == REMOVE_COLOR && q->color == c->remove_color) ||
-            (c->action == REMOVE_TYPE && q->type == c->remove_type)) {
-
-          /* keep track of removed piles */
-          removed[num_removed] = *p;
-          removed_table[num_removed] = p;
-          ++num_removed;
-
-          /* keep track of what is removed */
-          --s->pile_count;
-          for (card *r = *p; r; r = r->down)
-            remove_card(s, r);
-
-          /* remove from table (instead of advancing p) */
-          *p = (*p)->right;
-        } else {
-          p = &(*p)->right;
-        }
-      }
+    enum card_action action = (*m.hand)->action;
+    int removes = action == REMOVE_TYPE || action == REMOVE_COLOR
+                      ? __builtin_popcountll(cleared_tops(s, *m.hand))
+                      : -1;
+    if ((action == PLUS_ONE && m.extra &&
+         (m.hand == m.extra ? (*m.hand)->down : *m.extra)->action ==
+             PLUS_ONE) ||
+        removes >= 2 ||
+        (action == TAKE && m.extra &&
+         ((*m.extra)->action == REMOVE_TYPE ||
+          (*m.extra)->action == REMOVE_COLOR))) {
+      moves[i] = moves[good];
+      moves[good] = m;
+      ++good;
+      ++i;
     }
+    /* move take back +1 to back, move remove nothing to back */
+    else if ((action == TAKE && m.extra && (*m.extra)->action == PLUS_ONE) ||
+             removes == 0) {
+      moves[i] = moves[bad];
+      moves[bad] = m;
+      --bad;
+    } else {
+      ++i;
+    }
+  }
+}
 
-    if (m.extra) {
-      switch (c->action) {
-      case COVER: {
-        covered_card = m.extra;
-        while (*covered_card)
-          covered_card = &(*covered_card)->down;
-        *covered_card = c;
-        break;
-      }
-
-      case TAKE: {
-        /* iterate to tail of the hand */
-        card **h = &s->hands[player];
-        while (*h)
-          h = &(*h)->down;
-        pile_taken_hand = h;
+/* play move m of player: take its card from the hand, apply its action, put
+ * it on the table and draw a card. u records what unmake_move() restores */
+static void make_move(game_state *s, int player, move m, move_undo *u) {
+  int other = !player;
+  card *c = *m.hand;
+
+  u->hand = c;
+  u->key = s->key;
+  u->tops = s->tops;
+  u->unplayed = s->unplayed;
+  u->covered_top = NULL;
+  u->pile_taken_hand = NULL;
+  u->pile_taken_top = NULL;
+  u->num_removed = 0;
+
+  /* remove from hand */
+  *m.hand = c->down;
+  c->down = NULL;
+  xor_key(&s->key, &zobrist_hand[player][c - s->cards]);
+  s->unplayed ^= UINT64_C(1) << (c - s->cards);
+
+  u->extra = m.extra ? *m.extra : NULL;
+
+  uint64_t cleared = cleared_tops(s, c);
+  if (cleared) {
+    /* remove other piles with same color or type */
+    s->tops ^= cleared;
+    for (card **p = &s->table; *p;) {
+      if ((cleared >> ((*p)->top - s->cards)) & 1) {
+        /* keep track of removed piles */
+        u->removed[u->num_removed] = *p;
+        u->removed_table[u->num_removed] = p;
+        ++u->num_removed;
+        xor_pile_key(s, *p, &s->key);
+
+        /* keep track of what is removed */
+        --s->pile_count;
+        for (card *r = *p; r; r = r->down)
+          remove_card(s, r);
 
-        /* move pile to hand, and replace pile on table with card c */
-        card *tmp = *m.extra;
-        *m.extra = c;
-        c->right = tmp->right;
-        *h = tmp;
-        break;
+        /* remove from table (instead of advancing p) */
+        *p = (*p)->right;
+      } else {
+        p = &(*p)->right;
       }
+    }
+  }
 
-      case PLUS_ONE: {
-        card *second = *m.extra;
-        /* put it on the table */
-        second->right = s->table;
-        s->table = second;
-        /* remove it from the hand */
-        *m.extra = second->down;
-        second->down = NULL;
-        ++s->pile_count;
-        break;
-      }
+  if (m.extra) {
+    switch (c->action) {
+    case COVER: {
+      card *covered_top = (*m.extra)->top;
+      u->covered_top = covered_top;
+      covered_top->down = c;
+      (*m.extra)->top = c;
+      s->tops ^= UINT64_C(1) << (covered_top - s->cards) |
+                 UINT64_C(1) << (c - s->cards);
+      xor_key(&s->key, &zobrist_top[covered_top - s->cards]);
+      xor_key(&s->key, &zobrist_top[c - s->cards]);
+      xor_key(&s->key, &zobrist_pile[c - s->cards][*m.extra - s->cards]);
+      break;
+    }
 
-      case GIVE: {
-        card *give = *m.extra;
-        /* put it in the other player's hand */
-        card *tmp = s->hands[other];
-        s->hands[other] = give;
-        *m.extra = give->down;
-        give->down = tmp;
-        break;
-      }
-      default:
-        break;
+    case TAKE: {
+      /* iterate to tail of the hand */
+      card **h = &s->hands[player];
+      while (*h)
+        h = &(*h)->down;
+      u->pile_taken_hand = h;
+
+      /* move pile to hand, and replace pile on table with card c */
+      card *tmp = *m.extra;
+      u->pile_taken_top = tmp->top;
+      c->top = c;
+      s->tops ^= UINT64_C(1) << (tmp->top - s->cards) |
+                 UINT64_C(1) << (c - s->cards);
+      xor_pile_key(s, tmp, &s->key);
+      xor_pile_key(s, c, &s->key);
+      for (card *r = tmp; r; r = r->down) {
+        xor_key(&s->key, &zobrist_hand[player][r - s->cards]);
+        s->unplayed |= UINT64_C(1) << (r - s->cards);
       }
+      *m.extra = c;
+      c->right = tmp->right;
+      *h = tmp;
+      break;
     }
 
-    /* put card on the table */
-    if (!(m.extra && (c->action == COVER || c->action == TAKE))) {
-      c->right = s->table;
-      s->table = c;
+    case PLUS_ONE: {
+      card *second = *m.extra;
+      /* put it on the table */
+      second->right = s->table;
+      s->table = second;
+      /* remove it from the hand */
+      *m.extra = second->down;
+      second->down = NULL;
+      second->top = second;
       ++s->pile_count;
+      s->tops |= UINT64_C(1) << (second - s->cards);
+      s->unplayed ^= UINT64_C(1) << (second - s->cards);
+      xor_key(&s->key, &zobrist_hand[player][second - s->cards]);
+      xor_pile_key(s, second, &s->key);
+      break;
     }
 
-    /* take a card from the pile */
-    int draw_card = s->draw_pile_size > 0;
-
-    if (draw_card) {
-      card *drawn = s->pile[--s->draw_pile_size];
-      drawn->down = s->hands[player];
-      s->hands[player] = drawn;
+    case GIVE: {
+      card *give = *m.extra;
+      /* put it in the other player's hand */
+      card *tmp = s->hands[other];
+      s->hands[other] = give;
+      *m.extra = give->down;
+      give->down = tmp;
+      xor_key(&s->key, &zobrist_hand[player][give - s->cards]);
+      xor_key(&s->key, &zobrist_hand[other][give - s->cards]);
+      break;
+    }
+    default:
+      break;
     }
+  }
 
-    /* next turn */
-    ++s->depth;
-    won = play(s, other, c->action == REMOVE_TYPE || c->action == REMOVE_COLOR,
-               max_nodes, -1);
-    --s->depth;
+  /* put card on the table */
+  if (!(m.extra && (c->action == COVER || c->action == TAKE))) {
+    c->right = s->table;
+    s->table = c;
+    c->top = c;
+    ++s->pile_count;
+    s->tops |= UINT64_C(1) << (c - s->cards);
+    xor_pile_key(s, c, &s->key);
+  }
 
-    /* put card back on the pile */
-    if (draw_card) {
-      ++s->draw_pile_size;
-      card *drawn = s->hands[player];
-      s->hands[player] = drawn->down;
-      drawn->down = NULL;
-    }
+  /* take a card from the pile */
+  u->draw_card = s->draw_pile_size > 0;
+
+  if (u->draw_card) {
+    card *drawn = s->pile[--s->draw_pile_size];
+    if (s->draw_pile_size < s->min_draw_pile_size)
+      s->min_draw_pile_size = s->draw_pile_size;
+    drawn->down = s->hands[player];
+    s->hands[player] = drawn;
+    xor_key(&s->key, &zobrist_draw[s->draw_pile_size][drawn - s->cards]);
+    xor_key(&s->key, &zobrist_hand[player][drawn - s->cards]);
+  }
+}
+
+/* take back move m of player made by make_move() */
+static inline void unmake_move(game_state *s, int player, move m,
+                               move_undo *u) {
+  int other = !player;
+  card *c = u->hand;
+
+  s->key = u->key;
+  s->tops = u->tops;
+  s->unplayed = u->unplayed;
+
+  /* put card back on the pile */
+  if (u->draw_card) {
+    ++s->draw_pile_size;
+    card *drawn = s->hands[player];
+    s->hands[player] = drawn->down;
+    drawn->down = NULL;
+  }
+
+  /* remove card from table */
+  if (!(m.extra && (c->action == COVER || c->action == TAKE))) {
+    s->table = s->table->right;
+    --s->pile_count;
+  }
 
-    /* remove card from table */
-    if (!(m.extra && (c->action == COVER || c->action == TAKE))) {
+  /* reinsert removed piles */
+  for (int i = u->num_removed - 1; i >= 0; --i) {
+    card *tmp = *u->removed_table[i];
+    *u->removed_table[i] = u->removed[i];
+    u->removed[i]->right = tmp;
+
+    ++s->pile_count;
+    for (card *r = u->removed[i]; r; r = r->down)
+      add_card(s, r);
+  }
+
+  /* undo action */
+  if (m.extra) {
+    switch (c->action) {
+    case COVER:
+      u->covered_top->down = NULL;
+      (*m.extra)->top = u->covered_top;
+      break;
+    case TAKE: {
+      /* return taken pile to table if any */
+      card *tmp = *m.extra;
+      *m.extra = *u->pile_taken_hand;
+      (*m.extra)->right = tmp->right;
+      /* the cards may have been played as piles of their own */
+      (*m.extra)->top = u->pile_taken_top;
+      /* remove taken pile from hand */
+      *u->pile_taken_hand = NULL;
+      break;
+    }
+    case PLUS_ONE: {
+      /* put from table in hand */
+      card *tmp = *m.extra;
+      *m.extra = s->table;
+      s->table->down = tmp;
+      /* remove from table */
       s->table = s->table->right;
+      (*m.extra)->right = NULL; /* optional */
       --s->pile_count;
+      break;
     }
-
-    /* reinsert removed piles */
-    for (int i = num_removed - 1; i >= 0; --i) {
-      card *tmp = *removed_table[i];
-      *removed_table[i] = removed[i];
-      removed[i]->right = tmp;
-
-      ++s->pile_count;
-      for (card *r = removed[i]; r; r = r->down)
-        add_card(s, r);
+    case GIVE: {
+      card *tmp = *m.extra;
+      *m.extra = s->hands[other];
+      s->hands[other] = s->hands[other]->down;
+      (*m.extra)->down = tmp;
+      break;
     }
-
-    /* undo action */
-    if (m.extra) {
-      switch (c->action) {
-      case COVER:
-        *covered_card = NULL;
-        break;
-      case TAKE: {
-        /* return taken pile to table if any */
-        card *tmp = *m.extra;
-        *m.extra = *pile_taken_hand;
-        (*m.extra)->right = tmp->right;
-        /* remove taken pile from hand */
-        *pile_taken_hand = NULL;
-        break;
-      }
-      case PLUS_ONE: {
-        /* put from table in hand */
-        card *tmp = *m.extra;
-        *m.extra = s->table;
-        s->table->down = tmp;
-        /* remove from table */
-        s->table = s->table->right;
-        (*m.extra)->right = NULL; /* optional */
-        --s->pile_count;
-        break;
-      }
-      case GIVE: {
-        card *tmp = *m.extra;
-        *m.extra = s->hands[other];
-        s->hands[other] = s->hands[other]->down;
-        (*m.extra)->down = tmp;
-        break;
-      }
-      default:
-        break;
-      }
+    default:
+      break;
     }
+  }
 
-    /* put played card back in hand */
-    c->right = NULL;
-    c->down = *m.hand;
-    *m.hand = c;
+  /* put played card back in hand */
+  c->right = NULL;
+  c->down = *m.hand;
+  *m.hand = c;
+}
 
-    if (won != 0)
-      break;
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
 
-    /* hack */
-    if (s->depth > 0) {
-      s->stack[s->depth].hand = NULL;
-      s->stack[s->depth].extra = NULL;
-    }
-  }
+#ifdef BRAIN_LIBRARY
+#define verbose 0 /* the library does not print */
+#else
+static int verbose = 0;
+#endif
 
-  if (won == 1) {
-    if (verbose) {
-      fprintf(stdout, "[%d] ", s->depth);
-      print_state(stdout, s, 0);
-      fprintf(stdout, "\n");
-      fflush(stdout);
-    }
+/* returned by enter_node() once the moves of a node are generated */
+#define EXPANDED 2
 
-    return 1;
-  }
+/* the node at s->depth before its moves are searched: 1 or 0 if it is won or
+ * lost right away, -1 if the search stops here, or EXPANDED */
+static inline int enter_node(game_state *s, uint64_t max_nodes) {
+  search_frame *f = &s->stack[s->depth];
 
-  return won;
-}
+  ++s->nodes;
+  STAT(++s->stats.nodes_at_depth[s->depth]);
 
-static void init_state(game_state *s) {
-  /* init all cards */
+  if (verbose) {
+    indent(stderr, s->depth);
+    fprintf(stderr, "nodes: %" PRIu64 ". depth = %d\n", s->nodes, s->depth);
+    print_state(stderr, s, s->depth);
+    fprintf(stderr, "\n");
+    fflush(stderr);
+  }
+
+  if (s->pile_count >= s->max_piles) {
+    STAT(++s->stats.pile_cutoffs);
+    return 0;
+  }
+
+  /* no cards to play, skip to next player */
+  if (s->hands[f->player] == NULL)
+    f->player = !f->player;
+  int player = f->player;
+
+  /* both players are done, game is won */
+  if (s->hands[player] == NULL) {
+    if (verbose) {
+      fprintf(stdout, "[%d] ", s->depth);
+      print_state(stdout, s, 0);
+      fprintf(stdout, "\n");
+      fflush(stdout);
+    }
+    return 1;
+  }
+
+  /* too many cards stay on the table in the end, or right after this move */
+  if (!winnable(s)) {
+    STAT(++s->stats.winnable_cutoffs);
+    return 0;
+  }
+  if (!can_move(s, player)) {
+    STAT(++s->stats.stuck_cutoffs);
+    return 0;
+  }
+
+  /* proven results only; the root move is needed by the caller. the key
+   * covers the whole draw pile, so a hit depends on all of it */
+  f->position = canonical_key(&s->key) ^ (player ? zobrist_player : 0);
+  if (s->tt && s->depth > s->root_depth) {
+    int result = tt_probe(s->tt, f->position);
+    if (result != -1) {
+      STAT(++s->stats.tt_hits);
+      s->min_draw_pile_size = 0;
+      return result;
+    }
+  }
+  if (s->cards_left <= tablebase_cards && s->max_piles == tablebase_piles &&
+      s->depth > s->root_depth) {
+    STAT(++s->stats.tablebase_hits);
+    s->min_draw_pile_size = 0;
+    return !tablebase_lost(f->position);
+  }
+
+  if (s->nodes >= max_nodes) {
+    STAT(++s->stats.budget_cutoffs);
+    return -1;
+  }
+
+  /* poll for cancellation and the deadline now and then */
+  if ((s->nodes & 1023) == 0 &&
+      ((s->cancel && __atomic_load_n(s->cancel, __ATOMIC_RELAXED)) ||
+       (s->deadline > 0 && now() >= s->deadline)))
+    return -1;
+
+  move *moves = s->moves + f->first;
+  int legal_moves =
+      generate_moves(s, player, moves, max_nodes >= REDUCE_MIN_NODES);
+
+  STAT(++s->stats.expanded);
+  STAT(s->stats.legal_moves += legal_moves);
+
+  if (f->forced_move >= 0) {
+    /* force the dictated move */
+    if (legal_moves > 0) {
+      moves[0] = moves[f->forced_move % legal_moves];
+      legal_moves = 1;
+    }
+  } else {
+    order_moves(s, moves, legal_moves);
+  }
+
+  f->legal_moves = legal_moves;
+  f->i = 0;
+  return EXPANDED;
+}
+
+/* the node at s->depth is decided */
+static int leave_node(game_state *s, search_frame *f, int won) {
+  if (s->tt && s->depth > 0)
+    tt_store(s->tt, f->position, won);
+
+  if (s->proven && s->depth > 0 && (won == 1 || s->depth == 1))
+    proven_store(s->proven,
+                 s->key.shifted[0] ^ (f->player ? zobrist_player : 0), won,
+                 won ? (f->hand - s->cards) * 37 +
+                           (f->extra ? f->extra - s->cards : 36)
+                     : -1);
+
+  if (won == 1 && verbose) {
+    fprintf(stdout, "[%d] ", s->depth);
+    print_state(stdout, s, 0);
+    fprintf(stdout, "\n");
+    fflush(stdout);
+  }
+
+  return won;
+}
+
+/* start a search of s with player to move at s->depth; forced_move >= 0
+ * restricts the first move to that one of the legal moves */
+static void search_start(game_state *s, int player, int forced_move) {
+  s->root_depth = s->depth;
+  search_frame *f = &s->stack[s->depth];
+  f->player = player;
+  f->forced_move = forced_move;
+  /* the moves below are those of brain_make_move(), one per node */
+  f->first = s->depth;
+}
+
+/* search best-first depth-first until the position is decided or s->nodes
+ * reaches max_nodes. returns 1 or 0 for a win or a loss, or -1 with the moves
+ * of the current line still made, to be resumed by calling it again with a
+ * larger budget or dropped with search_abort(). the nodes are kept on
+ * s->stack, each one with its moves in s->moves and the undo record of the
+ * move it is searching. */
+static int search_resume(game_state *s, uint64_t max_nodes) {
+  int won = enter_node(s, max_nodes);
+  for (;;) {
+    if (won == -1)
+      return -1;
+
+    search_frame *f = &s->stack[s->depth];
+    if (won != EXPANDED) {
+      /* return won to the parent */
+      if (s->depth == s->root_depth)
+        return won;
+      f = &s->stack[--s->depth];
+      unmake_move(s, f->player, s->moves[f->first + f->i], &f->undo);
+
+      STAT(if (won == 1) count_win_index(&s->stats, f->i));
+
+      if (won != 0) {
+        won = leave_node(s, f, won);
+        continue;
+      }
+
+      /* hack */
+      if (s->depth > s->root_depth) {
+        f->hand = NULL;
+        f->extra = NULL;
+      }
+      ++f->i;
+    }
+
+    /* all moves are lost */
+    if (f->i == f->legal_moves) {
+      won = leave_node(s, f, 0);
+      continue;
+    }
+
+    /* next turn */
+    move m = s->moves[f->first + f->i];
+    make_move(s, f->player, m, &f->undo);
+    f->hand = f->undo.hand;
+    f->extra = f->undo.extra;
+
+    search_frame *child = &s->stack[++s->depth];
+    child->player = !f->player;
+    child->forced_move = -1;
+    child->first = f->first + f->legal_moves;
+    won = enter_node(s, max_nodes);
+  }
+}
+
+/* take back the moves of a search that returned -1 */
+static void search_abort(game_state *s) {
+  while (s->depth > s->root_depth) {
+    search_frame *f = &s->stack[--s->depth];
+    unmake_move(s, f->player, s->moves[f->first + f->i], &f->undo);
+  }
+}
+
+static int play(game_state *s, int player, uint64_t max_nodes,
+                int forced_move) {
+  search_start(s, player, forced_move);
+  int won = search_resume(s, max_nodes);
+  if (won == -1)
+    search_abort(s);
+  return won;
+}
+
+/* bitboard engine: the same rules as play(), but hands are masks of card
+ * indices and the table is a fixed array of piles, so that a position is a
+ * small struct that is copied on every move instead of lists that are patched
+ * and restored. */
+#define BB_PILE_SIZE 8 /* a card plus at most 6 cover cards */
+#define BB_NONE 36
+
+typedef struct bb_state {
+  uint64_t hands[2];                     /* bit i is set if card i is held */
+  uint8_t piles[PILE_LIMIT][BB_PILE_SIZE]; /* bottom card first */
+  uint8_t pile_size[PILE_LIMIT];
+  uint8_t top[PILE_LIMIT]; /* top card of each pile */
+  uint8_t pile_count;
+  uint8_t max_piles;
+  uint8_t draw_pile_size;
+  uint8_t cards_left;
+  uint8_t count_cover;
+  uint64_t left;
+  uint8_t can_remove_color;
+  uint8_t can_remove_type;
+} bb_state;
+
+typedef struct bb_move {
+  uint8_t hand;
+  /* the +1'd or given card, or the index of the covered or taken pile */
+  uint8_t extra;
+} bb_move;
+
+/* what stays the same during a search */
+typedef struct bb_search {
+  uint8_t draw_pile[36];
+  uint64_t draw_mask[37]; /* cards of the first i of the draw pile */
+  uint64_t nodes;
+  uint64_t max_nodes;
+  double deadline; /* see game_state */
+  int root_move; /* hand * 37 + (extra card or 36) of the last root move */
+  int min_draw_pile_size; /* see game_state */
+} bb_search;
+
+/* card properties by index, see init_state() */
+typedef struct bb_card {
+  uint8_t color, action, type, remove_color, remove_type;
+} bb_card;
+
+#define BB_CARD(i)                                                             \
+  {(i) % 6, (i) / 6, ((i) % 6 - (i) / 6 + 6) % 6, ((i) % 6 + 1) % 6,         \
+   (((i) % 6 - (i) / 6 + 6) % 6 + 5) % 6}
+
+static const bb_card bb_cards[36] = {
+    BB_CARD(0),  BB_CARD(1),  BB_CARD(2),  BB_CARD(3),  BB_CARD(4),
+    BB_CARD(5),  BB_CARD(6),  BB_CARD(7),  BB_CARD(8),  BB_CARD(9),
+    BB_CARD(10), BB_CARD(11), BB_CARD(12), BB_CARD(13), BB_CARD(14),
+    BB_CARD(15), BB_CARD(16), BB_CARD(17), BB_CARD(18), BB_CARD(19),
+    BB_CARD(20), BB_CARD(21), BB_CARD(22), BB_CARD(23), BB_CARD(24),
+    BB_CARD(25), BB_CARD(26), BB_CARD(27), BB_CARD(28), BB_CARD(29),
+    BB_CARD(30), BB_CARD(31), BB_CARD(32), BB_CARD(33), BB_CARD(34),
+    BB_CARD(35)};
+
+static inline int bb_color(int c) { return bb_cards[c].color; }
+static inline int bb_action(int c) { return bb_cards[c].action; }
+static inline int bb_type(int c) { return bb_cards[c].type; }
+static inline int bb_remove_color(int c) { return bb_cards[c].remove_color; }
+static inline int bb_remove_type(int c) { return bb_cards[c].remove_type; }
+
+static void bb_remove_card(bb_state *s, int c) {
+  switch (bb_action(c)) {
+  case COVER:
+    --s->count_cover;
+    break;
+  case REMOVE_TYPE:
+    s->can_remove_type ^= 1 << bb_remove_type(c);
+    break;
+  case REMOVE_COLOR:
+    s->can_remove_color ^= 1 << bb_remove_color(c);
+    break;
+  default:
+    break;
+  }
+
+  s->left ^= UINT64_C(1) << c;
+  --s->cards_left;
+}
+
+/* see winnable() */
+static inline uint64_t bb_removable(const bb_search *x, const bb_state *s) {
+  uint64_t unplayed =
+      s->hands[0] | s->hands[1] | x->draw_mask[s->draw_pile_size];
+  return removable_cards(s->left, unplayed, s->can_remove_color,
+                         s->can_remove_type);
+}
+
+static int bb_winnable(const bb_search *x, const bb_state *s) {
+  int removable = __builtin_popcountll(bb_removable(x, s));
+  return s->cards_left - removable - s->count_cover < s->max_piles;
+}
+
+/* see pile_class() */
+static inline int64_t bb_pile_class(const bb_state *s, int p,
+                                    uint64_t interchangeable) {
+  int64_t sig = 1;
+  for (int i = 0; i < s->pile_size[p]; ++i) {
+    int k = card_class(interchangeable, s->piles[p][i]);
+    if (k < 0)
+      return -1;
+    sig = sig << 3 | k;
+  }
+  return sig;
+}
+
+/* see can_move() */
+static int bb_can_move(const bb_state *s, int player) {
+  int piles_left = s->max_piles - s->pile_count;
+  if (piles_left > 2)
+    return 1;
+
+  uint64_t hand = s->hands[player];
+  for (uint64_t h = hand; h; h &= h - 1) {
+    int c = __builtin_ctzll(h);
+    switch (bb_action(c)) {
+    case COVER:
+      if (s->pile_count > 0 || piles_left > 1)
+        return 1;
+      break;
+    case TAKE:
+      if (piles_left > 1)
+        return 1;
+      for (int p = 0; p < s->pile_count; ++p)
+        if (bb_action(s->piles[p][0]) != TAKE)
+          return 1;
+      break;
+    case GIVE:
+      if (piles_left > 1)
+        return 1;
+      break;
+    case PLUS_ONE:
+      if (piles_left > 1 && hand == UINT64_C(1) << c)
+        return 1;
+      break;
+    case REMOVE_COLOR:
+      if (piles_left > 1)
+        return 1;
+      for (int p = 0; p < s->pile_count; ++p)
+        if (bb_color(s->top[p]) == bb_remove_color(c))
+          return 1;
+      break;
+    default:
+      if (piles_left > 1)
+        return 1;
+      for (int p = 0; p < s->pile_count; ++p)
+        if (bb_type(s->top[p]) == bb_remove_type(c))
+          return 1;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static void bb_push_pile(bb_state *s, int c) {
+  int p = s->pile_count++;
+  s->piles[p][0] = c;
+  s->pile_size[p] = 1;
+  s->top[p] = c;
+}
+
+/* play move m and draw a card */
+static void bb_make_move(bb_state *s, const bb_search *x, int player,
+                         bb_move m) {
+  int c = m.hand;
+  int action = bb_action(c);
+
+  s->hands[player] &= ~(UINT64_C(1) << c);
+
+  if (action == REMOVE_COLOR || action == REMOVE_TYPE) {
+    /* walk backwards so that moving the last pile into a hole is safe */
+    for (int p = s->pile_count - 1; p >= 0; --p) {
+      int t = s->top[p];
+      if ((action == REMOVE_COLOR && bb_color(t) == bb_remove_color(c)) ||
+          (action == REMOVE_TYPE && bb_type(t) == bb_remove_type(c))) {
+        for (int i = 0; i < s->pile_size[p]; ++i)
+          bb_remove_card(s, s->piles[p][i]);
+        int last = --s->pile_count;
+        if (p != last) {
+          for (int i = 0; i < s->pile_size[last]; ++i)
+            s->piles[p][i] = s->piles[last][i];
+          s->pile_size[p] = s->pile_size[last];
+          s->top[p] = s->top[last];
+        }
+      }
+    }
+  }
+
+  int on_table = 1;
+
+  if (m.extra != BB_NONE) {
+    switch (action) {
+    case COVER:
+      s->piles[m.extra][s->pile_size[m.extra]++] = c;
+      s->top[m.extra] = c;
+      on_table = 0;
+      break;
+    case TAKE:
+      /* move pile to hand, and replace pile on table with card c */
+      for (int i = 0; i < s->pile_size[m.extra]; ++i)
+        s->hands[player] |= UINT64_C(1) << s->piles[m.extra][i];
+      s->piles[m.extra][0] = c;
+      s->pile_size[m.extra] = 1;
+      s->top[m.extra] = c;
+      on_table = 0;
+      break;
+    case PLUS_ONE:
+      s->hands[player] &= ~(UINT64_C(1) << m.extra);
+      bb_push_pile(s, m.extra);
+      break;
+    case GIVE:
+      s->hands[player] &= ~(UINT64_C(1) << m.extra);
+      s->hands[!player] |= UINT64_C(1) << m.extra;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (on_table)
+    bb_push_pile(s, c);
+
+  /* take a card from the pile */
+  if (s->draw_pile_size > 0)
+    s->hands[player] |= UINT64_C(1) << x->draw_pile[--s->draw_pile_size];
+}
+
+static int bb_play(bb_search *x, const bb_state *s, int player,
+                   int forced_move, int depth) {
+  ++x->nodes;
+
+  if (s->pile_count >= s->max_piles)
+    return 0;
+
+  /* no cards to play, skip to next player */
+  if (s->hands[player] == 0)
+    player = !player;
+
+  /* both players are done, game is won */
+  if (s->hands[player] == 0)
+    return 1;
+
+  if (!bb_winnable(x, s) || !bb_can_move(s, player))
+    return 0;
+
+  if (x->nodes >= x->max_nodes)
+    return -1;
+
+  if ((x->nodes & 1023) == 0 && x->deadline > 0 && now() >= x->deadline)
+    return -1;
+
+  uint64_t hand = s->hands[player];
+  int cards_in_hand = __builtin_popcountll(hand);
+
+  /* count what's removable on table */
+  int color_count[6] = {0};
+  int type_count[6] = {0};
+  for (int p = 0; p < s->pile_count; ++p) {
+    ++color_count[bb_color(s->top[p])];
+    ++type_count[bb_type(s->top[p])];
+  }
+
+  bb_move moves[MAX_MOVES];
+  int legal_moves = 0;
+
+  /* generate all moves, see generate_moves() */
+  uint64_t same = 0, same_piles = 0;
+  if (x->max_nodes >= REDUCE_MIN_NODES && reduce_moves) {
+    same = interchangeable_cards(s->left, bb_removable(x, s));
+    uint64_t tops = 0;
+    for (int p = 0; p < s->pile_count; ++p)
+      tops |= UINT64_C(1) << s->top[p];
+    uint64_t t = same & tops, u = same & hand;
+    if (t & (t - 1))
+      same_piles = same;
+    if ((u & (u - 1)) == 0)
+      same = 0;
+  }
+  int played_classes = 0;
+  int piles_left = s->max_piles - s->pile_count;
+  for (uint64_t h = hand; h; h &= h - 1) {
+    int c = __builtin_ctzll(h);
+    int action = bb_action(c);
+    /* avoid creating more piles than allowed */
+    if (action == GIVE && piles_left <= 0)
+      continue;
+    else if (action == REMOVE_COLOR && piles_left <= 0 &&
+             color_count[bb_remove_color(c)] == 0)
+      continue;
+    else if (action == REMOVE_TYPE && piles_left <= 0 &&
+             type_count[bb_remove_type(c)] == 0)
+      continue;
+    else if (action == PLUS_ONE && piles_left <= (cards_in_hand == 1 ? 1 : 2))
+      continue;
+
+    if (same) {
+      int k = card_class(same, c);
+      if (k >= 0 && (played_classes >> k & 1))
+        continue;
+      if (k >= 0)
+        played_classes |= 1 << k;
+    }
+
+    if (action == GIVE || action == PLUS_ONE) {
+      uint64_t others = hand & ~(UINT64_C(1) << c);
+      int extra_classes = 0;
+      for (uint64_t e = others; e; e &= e - 1) {
+        int extra = __builtin_ctzll(e);
+        /* only enqueue (A, B), (B, A) once if A == B on PLUS_ONE actions */
+        if (action == PLUS_ONE && bb_action(extra) == PLUS_ONE && extra < c)
+          continue;
+        if (same) {
+          int k = card_class(same, extra);
+          if (k >= 0 && (extra_classes >> k & 1))
+            continue;
+          if (k >= 0)
+            extra_classes |= 1 << k;
+        }
+        moves[legal_moves++] = (bb_move){c, extra};
+      }
+      /* the card cannot be played with an extra */
+      if (others == 0)
+        moves[legal_moves++] = (bb_move){c, BB_NONE};
+    } else if (action == COVER || action == TAKE) {
+      int pairs = 0, seen = 0;
+      int64_t seen_piles[PILE_LIMIT];
+      for (int p = 0; p < s->pile_count; ++p) {
+        /* cannot take a pile with take back card */
+        if (action == TAKE && bb_action(s->piles[p][0]) == TAKE)
+          continue;
+        ++pairs;
+        if (same_piles) {
+          int64_t k = bb_pile_class(s, p, same_piles);
+          int i = 0;
+          while (k >= 0 && i < seen && seen_piles[i] != k)
+            ++i;
+          if (k >= 0 && i < seen)
+            continue;
+          if (k >= 0)
+            seen_piles[seen++] = k;
+        }
+        moves[legal_moves++] = (bb_move){c, p};
+      }
+      /* the card cannot be played with an extra */
+      if (pairs == 0 && s->pile_count < s->max_piles - 1)
+        moves[legal_moves++] = (bb_move){c, BB_NONE};
+    } else {
+      /* removal cards */
+      moves[legal_moves++] = (bb_move){c, BB_NONE};
+    }
+  }
+
+  if (forced_move >= 0) {
+    /* force the dictated move */
+    if (legal_moves > 0) {
+      moves[0] = moves[forced_move % legal_moves];
+      legal_moves = 1;
+    }
+  } else {
+    /* reorder moves best-first, see play() */
+    for (int good = 0, bad = legal_moves - 1, i = 0; i < bad;) {
+      bb_move m = moves[i];
+      int action = bb_action(m.hand);
+      int extra_action = -1;
+      if (m.extra != BB_NONE)
+        extra_action = bb_action(action == COVER || action == TAKE
+                                     ? s->piles[m.extra][0]
+                                     : m.extra);
+      if ((action == PLUS_ONE && extra_action == PLUS_ONE) ||
+          (action == REMOVE_TYPE && type_count[bb_remove_type(m.hand)] >= 2) ||
+          (action == REMOVE_COLOR &&
+           color_count[bb_remove_color(m.hand)] >= 2) ||
+          (action == TAKE &&
+           (extra_action == REMOVE_TYPE || extra_action == REMOVE_COLOR))) {
+        moves[i] = moves[good];
+        moves[good] = m;
+        ++good;
+        ++i;
+      } else if ((action == TAKE && extra_action == PLUS_ONE) ||
+                 (action == REMOVE_TYPE &&
+                  type_count[bb_remove_type(m.hand)] == 0) ||
+                 (action == REMOVE_COLOR &&
+                  color_count[bb_remove_color(m.hand)] == 0)) {
+        moves[i] = moves[bad];
+        moves[bad] = m;
+        --bad;
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  int won = 0;
+
+  for (int i = 0; i < legal_moves; ++i) {
+    bb_move m = moves[i];
+    int action = bb_action(m.hand);
+
+    if (depth == 0) {
+      int extra = m.extra;
+      if (extra != BB_NONE && (action == COVER || action == TAKE))
+        extra = s->piles[extra][0];
+      x->root_move = m.hand * 37 + extra;
+    }
+
+    /* a move that overflows the table is a lost leaf: count it without
+     * making the move */
+    int piles_after = s->pile_count + 1;
+    if (action == REMOVE_COLOR)
+      piles_after -= color_count[bb_remove_color(m.hand)];
+    else if (action == REMOVE_TYPE)
+      piles_after -= type_count[bb_remove_type(m.hand)];
+    else if (m.extra != BB_NONE)
+      piles_after += action == PLUS_ONE ? 1
+                     : action == COVER || action == TAKE ? -1
+                                                         : 0;
+    if (piles_after >= s->max_piles) {
+      ++x->nodes;
+      won = 0;
+      continue;
+    }
+
+    bb_state next = *s;
+    bb_make_move(&next, x, player, m);
+    if (next.draw_pile_size < x->min_draw_pile_size)
+      x->min_draw_pile_size = next.draw_pile_size;
+
+    won = bb_play(x, &next, !player, -1, depth + 1);
+
+    if (won != 0)
+      break;
+  }
+
+  return won;
+}
+
+/* convert a position of the pointer engine */
+static void bb_from_state(const game_state *g, bb_state *s, bb_search *x) {
+  for (int player = 0; player < 2; ++player) {
+    s->hands[player] = 0;
+    for (card *c = g->hands[player]; c; c = c->down)
+      s->hands[player] |= UINT64_C(1) << (c - g->cards);
+  }
+
+  s->pile_count = 0;
+  for (card *p = g->table; p; p = p->right) {
+    int n = 0;
+    for (card *q = p; q; q = q->down)
+      s->piles[s->pile_count][n++] = q - g->cards;
+    s->pile_size[s->pile_count] = n;
+    s->top[s->pile_count] = s->piles[s->pile_count][n - 1];
+    ++s->pile_count;
+  }
+  s->max_piles = g->max_piles;
+
+  s->draw_pile_size = g->draw_pile_size;
+  x->draw_mask[0] = 0;
+  for (int i = 0; i < g->draw_pile_size; ++i) {
+    x->draw_pile[i] = g->pile[i] - g->cards;
+    x->draw_mask[i + 1] = x->draw_mask[i] | UINT64_C(1) << x->draw_pile[i];
+  }
+
+  s->cards_left = g->cards_left;
+  s->count_cover = g->count_cover;
+  s->left = g->left;
+  s->can_remove_color = g->can_remove_color;
+  s->can_remove_type = g->can_remove_type;
+}
+
+static void init_state(game_state *s) {
+  /* init all cards */
   for (int i = 0; i < 36; ++i) {
     s->cards[i].right = NULL;
     s->cards[i].down = NULL;
@@ -618,9 +1854,11 @@ static void init_state(game_state *s) {
     s->cards[i].remove_color = (s->cards[i].color + 1) % 6;
     s->cards[i].remove_type = (s->cards[i].type + 5) % 6;
     s->cards[i].visible = 0;
+    s->cards[i].top = NULL;
   }
 
   s->table = NULL;
+  s->max_piles = difficulty;
   s->nodes = 0;
   s->depth = 0;
   s->draw_pile_size = 36;
@@ -629,7 +1867,7 @@ static void init_state(game_state *s) {
     s->hands[player] = NULL;
 
   /* no moves considered */
-  for (int i = 0; i < 100; ++i) {
+  for (int i = 0; i < MAX_DEPTH; ++i) {
     s->stack[i].hand = NULL;
     s->stack[i].extra = NULL;
   }
@@ -638,34 +1876,45 @@ static void init_state(game_state *s) {
     s->pile[i] = &s->cards[i];
 
   s->cards_left = 36;
-  for (int i = 0; i < 6; ++i)
-    s->left_of_color_type[i] = 0x3f;
+  s->left = UINT64_C(0xfffffffff);
   s->pile_count = 0;
   s->count_cover = 6;
+  s->tops = 0;
+  s->unplayed = UINT64_C(0xfffffffff);
 
   s->can_remove_color = 0x3f; /* 0b111111 */
   s->can_remove_type = 0x3f;  /* 0b111111 */
+
+  memset(&s->key, 0, sizeof(zobrist_key));
+  s->tt = NULL;
+  s->proven = NULL;
+  s->cancel = NULL;
+  s->deadline = 0;
+}
+
+/* deal the hands from the end of the deck in s->pile */
+static void deal(game_state *s) {
+  for (int player = 0; player < 2; ++player) {
+    for (int i = 0; i < NUM_START; ++i) {
+      card *c = s->pile[--s->draw_pile_size];
+      c->down = s->hands[player];
+      s->hands[player] = c;
+    }
+  }
 }
 
-static void random_init(game_state *s) {
+static void random_init(game_state *s, rng *r) {
   init_state(s);
 
   /* shuffle */
   for (int i = 0; i < s->draw_pile_size; ++i) {
-    int j = i + random_next() % (s->draw_pile_size - i);
+    int j = i + random_next(r) % (s->draw_pile_size - i);
     card *tmp = s->pile[j];
     s->pile[j] = s->pile[i];
     s->pile[i] = tmp;
   }
 
-  /* deal from the end of the deck */
-  for (int player = 0; player < 2; ++player) {
-    for (int i = 0; i < NUM_START; ++i) {
-      card *c = s->pile[--s->draw_pile_size];
-      c->down = s->hands[player];
-      s->hands[player] = c;
-    }
-  }
+  deal(s);
 }
 
 static void copy_game_state(game_state *src, game_state *dst) {
@@ -678,6 +1927,9 @@ static void copy_game_state(game_state *src, game_state *dst) {
     dst->cards[i].down = src->cards[i].down
                              ? dst->cards + (src->cards[i].down - src->cards)
                              : NULL;
+    dst->cards[i].top = src->cards[i].top
+                            ? dst->cards + (src->cards[i].top - src->cards)
+                            : NULL;
   }
 
   for (int player = 0; player < 2; ++player)
@@ -685,7 +1937,7 @@ static void copy_game_state(game_state *src, game_state *dst) {
                              ? dst->cards + (src->hands[player] - src->cards)
                              : NULL;
 
-  for (int i = 0; i < 100; ++i) {
+  for (int i = 0; i < MAX_DEPTH; ++i) {
     dst->stack[i].hand = src->stack[i].hand
                              ? dst->cards + (src->stack[i].hand - src->cards)
                              : NULL;
@@ -700,300 +1952,3525 @@ static void copy_game_state(game_state *src, game_state *dst) {
   dst->table = src->table ? dst->cards + (src->table - src->cards) : NULL;
 
   dst->cards_left = src->cards_left;
-  for (int i = 0; i < 6; ++i)
-    dst->left_of_color_type[i] = src->left_of_color_type[i];
+  dst->left = src->left;
   dst->pile_count = src->pile_count;
+  dst->max_piles = src->max_piles;
   dst->count_cover = src->count_cover;
+  dst->tops = src->tops;
+  dst->unplayed = src->unplayed;
 
   dst->can_remove_color = src->can_remove_color;
   dst->can_remove_type = src->can_remove_type;
-}
 
-static saved_move idx_to_move(game_state *s, int idx) {
-  int hand = idx / 37;
-  int extra = idx % 37;
-  saved_move m = {.hand = s->cards + hand,
-                  .extra = extra == 36 ? NULL : s->cards + extra};
-
-  return m;
+  /* dst keeps its own transposition table */
+  dst->key = src->key;
 }
 
-int main(void) {
-  game_state simulation;
-  game_state game;
+/* a position without pointers: cards are indices into game_state.cards, so
+ * that a snapshot is a single memcpy of a small struct. it holds no search,
+ * see pack_state() and unpack_state() */
+typedef struct packed_state {
+  uint64_t left;     /* see game_state */
+  uint64_t tops;     /* see game_state */
+  uint64_t unplayed; /* see game_state */
+  uint64_t visible;  /* cards that were taken or given */
+  zobrist_key key;
+  uint8_t hands[2][36];  /* top card first */
+  uint8_t hand_size[2];
+  uint8_t draw_pile[36]; /* see game_state.pile */
+  uint8_t draw_pile_size;
+  uint8_t piles[PILE_LIMIT][BB_PILE_SIZE]; /* bottom card first */
+  uint8_t pile_size[PILE_LIMIT];
+  uint8_t pile_count;
+  uint8_t max_piles;
+  uint8_t cards_left;
+  uint8_t count_cover;
+  uint8_t can_remove_color;
+  uint8_t can_remove_type;
+} packed_state;
+
+static void pack_state(const game_state *s, packed_state *p) {
+  for (int player = 0; player < 2; ++player) {
+    int n = 0;
+    for (card *c = s->hands[player]; c; c = c->down)
+      p->hands[player][n++] = c - s->cards;
+    p->hand_size[player] = n;
+  }
 
-  int games_won = 0;
-  init_state(&simulation);
+  p->visible = 0;
+  for (int i = 0; i < 36; ++i) {
+    p->draw_pile[i] = s->pile[i] - s->cards;
+    if (s->cards[i].visible)
+      p->visible |= UINT64_C(1) << i;
+  }
+  p->draw_pile_size = s->draw_pile_size;
+
+  p->pile_count = 0;
+  for (card *c = s->table; c; c = c->right) {
+    int n = 0;
+    for (card *q = c; q; q = q->down)
+      p->piles[p->pile_count][n++] = q - s->cards;
+    p->pile_size[p->pile_count++] = n;
+  }
+
+  p->left = s->left;
+  p->tops = s->tops;
+  p->unplayed = s->unplayed;
+  p->key = s->key;
+  p->max_piles = s->max_piles;
+  p->cards_left = s->cards_left;
+  p->count_cover = s->count_cover;
+  p->can_remove_color = s->can_remove_color;
+  p->can_remove_type = s->can_remove_type;
+}
+
+/* s must have been set up by init_state(). it keeps its own search state and
+ * tables, and starts at depth 0 */
+static void unpack_state(const packed_state *p, game_state *s) {
+  for (int i = 0; i < 36; ++i) {
+    s->cards[i].right = NULL;
+    s->cards[i].down = NULL;
+    s->cards[i].top = NULL;
+    s->cards[i].visible = p->visible >> i & 1;
+    s->pile[i] = s->cards + p->draw_pile[i];
+  }
+  s->draw_pile_size = p->draw_pile_size;
+
+  for (int player = 0; player < 2; ++player) {
+    card **h = &s->hands[player];
+    for (int i = 0; i < p->hand_size[player]; ++i) {
+      *h = s->cards + p->hands[player][i];
+      h = &(*h)->down;
+    }
+    *h = NULL;
+  }
+
+  /* link the piles back to front */
+  s->table = NULL;
+  for (int i = p->pile_count - 1; i >= 0; --i) {
+    card *bottom = s->cards + p->piles[i][0];
+    for (int j = 1; j < p->pile_size[i]; ++j)
+      s->cards[p->piles[i][j - 1]].down = s->cards + p->piles[i][j];
+    bottom->top = s->cards + p->piles[i][p->pile_size[i] - 1];
+    bottom->right = s->table;
+    s->table = bottom;
+  }
+  s->pile_count = p->pile_count;
+
+  s->left = p->left;
+  s->tops = p->tops;
+  s->unplayed = p->unplayed;
+  s->key = p->key;
+  s->max_piles = p->max_piles;
+  s->cards_left = p->cards_left;
+  s->count_cover = p->count_cover;
+  s->can_remove_color = p->can_remove_color;
+  s->can_remove_type = p->can_remove_type;
+  s->depth = 0;
+}
+
+/* set up s from the hands, the top of the draw pile, the piles, the pile limit
+ * and the visible cards of p, with the cards that are not in left discarded.
+ * the rest of p is filled in */
+static void set_position(packed_state *p, uint64_t left, game_state *s) {
+  uint64_t draw = 0;
+  for (int i = 0; i < p->draw_pile_size; ++i)
+    draw |= UINT64_C(1) << p->draw_pile[i];
+  /* the rest of the pile holds the other cards, see init_state() */
+  for (int c = 0, n = p->draw_pile_size; c < 36; ++c)
+    if (!(draw >> c & 1))
+      p->draw_pile[n++] = c;
+
+  init_state(s);
+  p->left = left;
+  p->unplayed = draw;
+  for (int i = 0; i < 2; ++i)
+    for (int j = 0; j < p->hand_size[i]; ++j)
+      p->unplayed |= UINT64_C(1) << p->hands[i][j];
+  p->tops = 0;
+  for (int i = 0; i < p->pile_count; ++i)
+    p->tops |= UINT64_C(1) << p->piles[i][p->pile_size[i] - 1];
+  p->cards_left = __builtin_popcountll(left);
+  p->count_cover = s->count_cover;
+  p->can_remove_color = s->can_remove_color;
+  p->can_remove_type = s->can_remove_type;
+  /* as if the discarded cards were removed, see remove_card() */
+  for (int c = 0; c < 36; ++c) {
+    if (left >> c & 1)
+      continue;
+    if (s->cards[c].action == COVER)
+      --p->count_cover;
+    else if (s->cards[c].action == REMOVE_COLOR)
+      p->can_remove_color ^= 1 << s->cards[c].remove_color;
+    else if (s->cards[c].action == REMOVE_TYPE)
+      p->can_remove_type ^= 1 << s->cards[c].remove_type;
+  }
+  unpack_state(p, s);
+  s->key = state_key(s);
+}
+
+static saved_move idx_to_move(game_state *s, int idx) {
+  int hand = idx / 37;
+  int extra = idx % 37;
+  saved_move m = {.hand = s->cards + hand,
+                  .extra = extra == 36 ? NULL : s->cards + extra};
+
+  return m;
+}
+
+enum engine { POINTER_ENGINE, BITBOARD_ENGINE };
+
+static enum engine engine = POINTER_ENGINE;
+
+/* search with the selected engine and store the first move played in
+ * *move_idx as hand * 37 + (extra or 36), or -1 if there was none. the
+ * smallest draw pile size it reached, or 0 if it used a proven result of the
+ * whole draw pile, is left in s->min_draw_pile_size */
+static int search(game_state *s, int player, uint64_t max_nodes,
+                  int forced_move, int *move_idx) {
+  if (engine == BITBOARD_ENGINE) {
+    bb_state b;
+    bb_search x = {.nodes = 0,
+                   .max_nodes = max_nodes,
+                   .deadline = s->deadline,
+                   .root_move = -1,
+                   .min_draw_pile_size = s->draw_pile_size};
+    bb_from_state(s, &b, &x);
+    int result = bb_play(&x, &b, player, forced_move, 0);
+    s->nodes = x.nodes;
+    s->min_draw_pile_size = x.min_draw_pile_size;
+    *move_idx = x.root_move;
+    return result;
+  }
+
+  s->nodes = 0;
+  s->min_draw_pile_size = s->draw_pile_size;
+  s->stack[s->depth].hand = NULL;
+  s->stack[s->depth].extra = NULL;
+  s->key = state_key(s);
+  int result = play(s, player, max_nodes, forced_move);
+  search_frame *f = &s->stack[s->depth];
+  *move_idx = f->hand ? (f->hand - s->cards) * 37 +
+                            (f->extra ? f->extra - s->cards : 36)
+                      : -1;
+  return result;
+}
+
+/* locate the move of player with the cards of m in the lists of s */
+static move find_move(game_state *s, int player, saved_move best) {
+  move m = {NULL, NULL};
+  for (m.hand = &s->hands[player]; *m.hand != best.hand;
+       m.hand = &(*m.hand)->down)
+    ;
+
+  if (best.extra) {
+    /* locate other card in hand */
+    if (best.hand->action == GIVE || best.hand->action == PLUS_ONE) {
+      for (m.extra = &s->hands[player]; *m.extra != best.extra;
+           m.extra = &(*m.extra)->down)
+        ;
+      /* the card below the played one moves up, see generate_moves() */
+      if (m.extra == &best.hand->down)
+        m.extra = m.hand;
+    }
+    /* locate pile */
+    if (best.hand->action == COVER || best.hand->action == TAKE) {
+      for (m.extra = &s->table; *m.extra != best.extra;
+           m.extra = &(*m.extra)->right)
+        ;
+    }
+  }
+  return m;
+}
+
+/* play a move in the actual game, marking given and taken cards as open */
+static void play_move(game_state *game, int player, saved_move best) {
+  move_undo u;
+  make_move(game, player, find_move(game, player, best), &u);
+
+  if (best.extra && best.hand->action == TAKE)
+    for (card *r = best.extra; r; r = r->down)
+      r->visible = 1;
+  if (best.extra && best.hand->action == GIVE)
+    best.extra->visible = 1;
+}
+
+/* the library, see brain.h */
+static pthread_once_t zobrist_once = PTHREAD_ONCE_INIT;
+
+brain_state *brain_new(uint64_t seed, int max_piles) {
+  if (max_piles < 1 || max_piles > PILE_LIMIT)
+    return NULL;
+  pthread_once(&zobrist_once, init_zobrist);
+
+  game_state *s = calloc(1, sizeof(game_state));
+  if (s == NULL)
+    return NULL;
+  rng r;
+  for (int i = 0; i < 4; ++i)
+    r.s[i] = splitmix64(&seed);
+  random_init(s, &r);
+  s->max_piles = max_piles;
+  s->tt = calloc(UINT64_C(1) << TT_BITS, sizeof(uint64_t));
+  if (s->tt == NULL) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+void brain_free(brain_state *s) {
+  if (s)
+    free(s->tt);
+  free(s);
+}
+
+int brain_hand(const brain_state *s, int player, int *cards) {
+  int n = 0;
+  for (card *c = s->hands[player]; c; c = c->down)
+    cards[n++] = c - s->cards;
+  return n;
+}
+
+int brain_piles(const brain_state *s, int *tops) {
+  int n = 0;
+  for (card *p = s->table; p; p = p->right)
+    tops[n++] = p->top - s->cards;
+  return n;
+}
+
+int brain_draw_pile_size(const brain_state *s) { return s->draw_pile_size; }
+
+int brain_generate_moves(brain_state *s, int player, int *moves) {
+  move m[MAX_MOVES];
+  int legal_moves = generate_moves(s, player, m, 0);
+  for (int i = 0; i < legal_moves; ++i)
+    moves[i] = move_to_idx(s, m[i]);
+  return legal_moves;
+}
+
+/* the move is kept in the node at s->depth, like a move of the search, which
+ * starts below it */
+int brain_make_move(brain_state *s, int player, int move_idx) {
+  if (s->depth >= MAX_DEPTH - 1 || move_idx < 0 || move_idx >= 36 * 37)
+    return -1;
+
+  move m[MAX_MOVES];
+  int legal_moves = generate_moves(s, player, m, 0);
+  int i = 0;
+  while (i < legal_moves && move_to_idx(s, m[i]) != move_idx)
+    ++i;
+  if (i == legal_moves)
+    return -1;
+
+  search_frame *f = &s->stack[s->depth];
+  f->player = player;
+  f->first = s->depth;
+  f->legal_moves = 1;
+  f->i = 0;
+  s->moves[f->first] = m[i];
+  make_move(s, player, m[i], &f->undo);
+  f->hand = f->undo.hand;
+  f->extra = f->undo.extra;
+  ++s->depth;
+  return 0;
+}
+
+void brain_unmake_move(brain_state *s) {
+  if (s->depth == 0)
+    return;
+  search_frame *f = &s->stack[--s->depth];
+  unmake_move(s, f->player, s->moves[f->first], &f->undo);
+}
+
+int brain_search(brain_state *s, int player, uint64_t max_nodes, int *move) {
+  return search(s, player, max_nodes, -1, move);
+}
+
+#ifndef BRAIN_LIBRARY
+
+/* a game state takes about 500 KB, too much for the stack of a thread */
+static game_state *state_alloc(void) {
+  game_state *s = malloc(sizeof(game_state));
+  if (s == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  init_state(s);
+  return s;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* counts per move, indexed by hand * 37 + (extra or 36) */
+typedef struct turn_stats {
+  int win_count[36 * 37];
+  int loss_count[36 * 37];
+  int unknown_count[36 * 37];
+  int wins;
+  int losses;
+  uint64_t nodes;  /* nodes searched */
+  int searches;    /* number of searches */
+  int cutoffs;     /* searches that ran out of nodes */
+  int cache_hits;  /* simulations answered by the result cache */
+  int proven_hits; /* simulations proven by earlier turns */
+  /* in paired mode, how many times more simulations independent deals would
+   * need to compare the two best moves as accurately; 0 if unknown */
+  double paired_gain;
+#ifdef SEARCH_STATS
+  search_stats search;
+#endif
+} turn_stats;
+
+static void clear_stats(turn_stats *t) {
+  for (int i = 0; i < 36 * 37; ++i) {
+    t->win_count[i] = 0;
+    t->loss_count[i] = 0;
+    t->unknown_count[i] = 0;
+  }
+  t->wins = 0;
+  t->losses = 0;
+  t->nodes = 0;
+  t->searches = 0;
+  t->cutoffs = 0;
+  t->cache_hits = 0;
+  t->proven_hits = 0;
+  t->paired_gain = 0;
+  STAT(clear_search_stats(&t->search));
+}
+
+static void add_stats(turn_stats *dst, turn_stats *src) {
+  for (int i = 0; i < 36 * 37; ++i) {
+    dst->win_count[i] += src->win_count[i];
+    dst->loss_count[i] += src->loss_count[i];
+    dst->unknown_count[i] += src->unknown_count[i];
+  }
+  dst->wins += src->wins;
+  dst->losses += src->losses;
+  dst->nodes += src->nodes;
+  dst->searches += src->searches;
+  dst->cutoffs += src->cutoffs;
+  dst->cache_hits += src->cache_hits;
+  dst->proven_hits += src->proven_hits;
+  STAT(add_search_stats(&dst->search, &src->search));
+}
+
+/* adaptive allocation of simulations over root moves by successive
+ * elimination: a move is dropped once the upper confidence bound of its mean
+ * (2 * win + unknown) / 2 is below the lower bound of another move. bounds are
+ * normal approximations, bonferroni corrected over the moves, with one win
+ * and one loss added to the variance so that few samples are not trusted. the
+ * turn stops when one move is left, or when the best move is at most
+ * SCHEDULER_EPSILON worse than any other with the same confidence. */
+#define SCHEDULER_MIN_SAMPLES 16
+#define SCHEDULER_EPSILON 0.02
+
+static double adaptive_delta = 0; /* 0 forces root moves round robin */
+
+typedef struct root_arm {
+  int samples;
+  int pending; /* simulations of this move that are running */
+  double sum;
+  double sum_sq;
+  int active;
+} root_arm;
+
+typedef struct scheduler {
+  pthread_mutex_t lock;
+  double z; /* quantile of the confidence bounds */
+  int num_arms;
+  int num_active;
+  root_arm arms[300];
+} scheduler;
+
+/* z such that P(Z > z) = p for a standard normal Z */
+static double normal_quantile(double p) {
+  double lo = 0, hi = 40;
+  for (int i = 0; i < 100; ++i) {
+    double mid = (lo + hi) / 2;
+    if (0.5 * erfc(mid / sqrt(2)) > p)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void scheduler_init(scheduler *q, int num_arms, double delta) {
+  pthread_mutex_init(&q->lock, NULL);
+  q->z = normal_quantile(delta / num_arms);
+  q->num_arms = num_arms;
+  q->num_active = num_arms;
+  for (int i = 0; i < num_arms; ++i) {
+    q->arms[i].samples = 0;
+    q->arms[i].pending = 0;
+    q->arms[i].sum = 0;
+    q->arms[i].sum_sq = 0;
+    q->arms[i].active = 1;
+  }
+}
+
+/* the active root move with the fewest simulations */
+static int scheduler_next(scheduler *q) {
+  pthread_mutex_lock(&q->lock);
+  int best = -1;
+  for (int i = 0; i < q->num_arms; ++i) {
+    root_arm *a = &q->arms[i];
+    if (a->active && (best == -1 || a->samples + a->pending <
+                                        q->arms[best].samples +
+                                            q->arms[best].pending))
+      best = i;
+  }
+  ++q->arms[best].pending;
+  pthread_mutex_unlock(&q->lock);
+  return best;
+}
+
+static double confidence_radius(scheduler *q, root_arm *a) {
+  double n = a->samples + 2;
+  double mean = (a->sum + 1) / n;
+  double var = (a->sum_sq + 1) / n - mean * mean;
+  return q->z * sqrt(var / a->samples);
+}
+
+/* record the value in [0, 1] of a simulation of a root move and drop the
+ * moves that are worse; returns 1 once the best move is known */
+static int scheduler_report(scheduler *q, int arm, double value) {
+  pthread_mutex_lock(&q->lock);
+  root_arm *a = &q->arms[arm];
+  --a->pending;
+  ++a->samples;
+  a->sum += value;
+  a->sum_sq += value * value;
+
+  /* the best move by lower bound, once all moves have enough samples */
+  int best = -1;
+  double best_lower = -1;
+  for (int i = 0; i < q->num_arms; ++i) {
+    root_arm *b = &q->arms[i];
+    if (!b->active)
+      continue;
+    if (b->samples < SCHEDULER_MIN_SAMPLES) {
+      pthread_mutex_unlock(&q->lock);
+      return 0;
+    }
+    double lower = b->sum / b->samples - confidence_radius(q, b);
+    if (lower > best_lower) {
+      best_lower = lower;
+      best = i;
+    }
+  }
+
+  double max_upper = -1;
+  for (int i = 0; i < q->num_arms; ++i) {
+    root_arm *b = &q->arms[i];
+    if (!b->active || i == best)
+      continue;
+    double upper = b->sum / b->samples + confidence_radius(q, b);
+    if (upper < best_lower) {
+      b->active = 0;
+      --q->num_active;
+    } else if (upper > max_upper) {
+      max_upper = upper;
+    }
+  }
+
+  int done = q->num_active == 1 || max_upper <= best_lower + SCHEDULER_EPSILON;
+  pthread_mutex_unlock(&q->lock);
+  return done;
+}
+
+/* sums over determinizations in which every root move was searched, to
+ * compare moves on paired outcomes (common random numbers) */
+typedef struct paired_stats {
+  pthread_mutex_t lock;
+  double z; /* quantile of the confidence bounds for an early stop, or 0 */
+  int num_arms;
+  int samples;
+  double sum[300];
+  double sum_sq[300];
+  double *cross; /* sums of products of the values of two moves */
+} paired_stats;
+
+static int paired_mode = 0;
+
+static void paired_init(paired_stats *p, int num_arms, double delta) {
+  pthread_mutex_init(&p->lock, NULL);
+  p->z = delta > 0 ? normal_quantile(delta / num_arms) : 0;
+  p->num_arms = num_arms;
+  p->samples = 0;
+  for (int i = 0; i < num_arms; ++i) {
+    p->sum[i] = 0;
+    p->sum_sq[i] = 0;
+  }
+  p->cross = calloc(num_arms * num_arms, sizeof(double));
+  if (p->cross == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+}
+
+static void paired_free(paired_stats *p) {
+  pthread_mutex_destroy(&p->lock);
+  free(p->cross);
+}
+
+/* variance of the difference of the values of moves i and j */
+static double paired_variance(paired_stats *p, int i, int j) {
+  double n = p->samples;
+  double mean = (p->sum[i] - p->sum[j]) / n;
+  return (p->sum_sq[i] + p->sum_sq[j] - 2 * p->cross[i * p->num_arms + j]) /
+             n -
+         mean * mean;
+}
+
+static double marginal_variance(paired_stats *p, int i) {
+  double mean = p->sum[i] / p->samples;
+  return p->sum_sq[i] / p->samples - mean * mean;
+}
+
+/* the moves with the highest and second highest total value */
+static void paired_best(paired_stats *p, int *best, int *second) {
+  *best = *second = -1;
+  for (int i = 0; i < p->num_arms; ++i) {
+    if (*best == -1 || p->sum[i] > p->sum[*best]) {
+      *second = *best;
+      *best = i;
+    } else if (*second == -1 || p->sum[i] > p->sum[*second]) {
+      *second = i;
+    }
+  }
+}
+
+/* add the values of all moves in one determinization; returns 1 once the
+ * best move is better than every other by more than the confidence bound of
+ * their paired difference, or at most SCHEDULER_EPSILON worse */
+static int paired_report(paired_stats *p, double *value) {
+  pthread_mutex_lock(&p->lock);
+  ++p->samples;
+  for (int i = 0; i < p->num_arms; ++i) {
+    p->sum[i] += value[i];
+    p->sum_sq[i] += value[i] * value[i];
+    for (int j = 0; j < p->num_arms; ++j)
+      p->cross[i * p->num_arms + j] += value[i] * value[j];
+  }
+
+  int done = 0;
+  if (p->z > 0 && p->samples >= SCHEDULER_MIN_SAMPLES) {
+    int best, second;
+    paired_best(p, &best, &second);
+    done = 1;
+    for (int j = 0; j < p->num_arms && done; ++j) {
+      if (j == best)
+        continue;
+      /* one pseudo sample of each sign, like the scheduler */
+      double n = p->samples;
+      double var = (paired_variance(p, best, j) * n + 1) / (n + 2);
+      double lower = (p->sum[best] - p->sum[j]) / n - p->z * sqrt(var / n);
+      done = lower > -SCHEDULER_EPSILON;
+    }
+  }
+
+  pthread_mutex_unlock(&p->lock);
+  return done;
+}
+
+/* monte carlo simulations of one turn, shared by all workers */
+typedef struct simulation_task {
+  game_state *game;
+  int player;
+  int next_run;               /* next simulation to claim */
+  int done;                   /* a move certainly wins, stop simulating */
+  int win_count[36 * 37];     /* wins over all workers, for early exit */
+  scheduler *scheduler;       /* picks the root moves, or NULL */
+  paired_stats *paired;       /* searches every root move per run, or NULL */
+  double deadline;            /* simulate until this time instead, or 0 */
+  int min_runs;               /* runs before the deadline is checked */
+  int legal_moves;            /* root moves, forced modulo this number */
+} simulation_task;
+
+/* search results of the determinizations of a turn. a search only sees the
+ * other player's hand and the draw pile down to the last card it drew, so a
+ * determinization that agrees on those is the same position within the reach
+ * of the search, and its proven result for a root move is reused. unknown
+ * results are not cached: whether a search runs out of nodes depends on the
+ * order of the hand and the contents of the transposition table, which the
+ * key leaves out. entries are keyed on the root move, the cards in the other
+ * player's hand and the drawn cards in order from the top of the pile, and
+ * always replaced. */
+#define RESULT_CACHE_BITS 14
+
+typedef struct cached_result {
+  uint64_t key;     /* 0 if empty */
+  int16_t card_idx; /* see search() */
+  int8_t result;
+  uint8_t drawn; /* cards the search drew from the pile */
+} cached_result;
+
+typedef struct worker {
+  pthread_t thread;
+  simulation_task *task;
+  game_state simulation;
+  rng rng;
+  turn_stats stats;
+  cached_result *cache;
+  int max_drawn; /* largest drawn of the entries in the cache */
+} worker;
+
+/* redeal the cards of the other player that are not known from the pile */
+static void determinize(game_state *simulation, int other, rng *r) {
+  /* put the other player's cards back in the pile */
+  int num_cards_other_player = 0;
+  card **other_hand = &simulation->hands[other];
+  while (*other_hand) {
+    /* retain visible cards */
+    if ((*other_hand)->visible) {
+      other_hand = &(*other_hand)->down;
+      continue;
+    }
+    /* put non-visible cards back in the pile */
+    simulation->pile[simulation->draw_pile_size] = *other_hand;
+    *other_hand = (*other_hand)->down;
+    simulation->pile[simulation->draw_pile_size]->down = NULL;
+    ++simulation->draw_pile_size;
+    ++num_cards_other_player;
+  }
+
+  /* shuffle the deck */
+  for (int i = 0; i < simulation->draw_pile_size; ++i) {
+    int j = i + random_next(r) % (simulation->draw_pile_size - i);
+    card *tmp = simulation->pile[j];
+    simulation->pile[j] = simulation->pile[i];
+    simulation->pile[i] = tmp;
+  }
+
+  /* deal the other player new cards */
+  for (int i = 0; i < num_cards_other_player; ++i) {
+    card *c = simulation->pile[--simulation->draw_pile_size];
+    c->down = simulation->hands[other];
+    simulation->hands[other] = c;
+  }
+}
+
+/* the result of the forced root move of a determinization if earlier searches
+ * proved it, see proven_store(), or -1 */
+static int proven_move(game_state *s, int player, int forced_move,
+                       int *card_idx) {
+  if (s->proven == NULL)
+    return -1;
+
+  /* see enter_node() */
+  if (s->hands[player] == NULL)
+    player = !player;
+  int won_idx;
+  uint64_t key = state_key(s).shifted[0] ^ (player ? zobrist_player : 0);
+  int result = proven_probe(s->proven, key, &won_idx);
+  if (result == -1)
+    return -1;
+
+  move moves[MAX_MOVES];
+  int legal_moves = generate_moves(s, player, moves, 0);
+  if (legal_moves == 0)
+    return -1;
+  int idx = move_to_idx(s, moves[forced_move % legal_moves]);
+
+  /* every move of a lost position loses */
+  if (result == 1 && idx != won_idx)
+    return -1;
+  *card_idx = idx;
+  return result;
+}
+
+static inline uint64_t cache_mix(uint64_t h, uint64_t x) {
+  h = (h ^ x) * UINT64_C(0x9e3779b97f4a7c15);
+  return h ^ h >> 32;
+}
+
+/* monte carlo simulations per turn without a deadline */
+static int total_simulations = TOTAL_SIMULATIONS;
+
+/* search the forced root move of a determinization, or look it up in the
+ * cache, and count the result */
+static int simulate_move(worker *w, int forced_move) {
+  simulation_task *task = w->task;
+  game_state *simulation = &w->simulation;
+
+  /* keys[k] covers the top k cards of the draw pile */
+  uint64_t keys[37];
+  int size = simulation->draw_pile_size;
+  uint64_t hand = 0;
+  for (card *c = simulation->hands[!task->player]; c; c = c->down)
+    hand |= UINT64_C(1) << (c - simulation->cards);
+  keys[0] = cache_mix(
+      cache_mix(0, task->legal_moves ? forced_move % task->legal_moves : 0),
+      hand);
+  int hashed = 0;
+
+  int card_idx = -1, result = -1;
+  cached_result *e = NULL;
+  for (int k = 0; k <= w->max_drawn && k <= size; ++k) {
+    if (k > hashed) {
+      keys[k] = cache_mix(keys[k - 1],
+                          simulation->pile[size - k] - simulation->cards);
+      hashed = k;
+    }
+    cached_result *c =
+        &w->cache[keys[k] & ((UINT64_C(1) << RESULT_CACHE_BITS) - 1)];
+    if (c->key == (keys[k] | 1) && c->drawn == k) {
+      e = c;
+      break;
+    }
+  }
+
+  if (e) {
+    card_idx = e->card_idx;
+    result = e->result;
+    ++w->stats.cache_hits;
+  } else if ((result = proven_move(simulation, task->player, forced_move,
+                                   &card_idx)) != -1) {
+    ++w->stats.proven_hits;
+  } else {
+    result = search(simulation, task->player, MAX_NODES_PER_SIMULATION,
+                    forced_move, &card_idx);
+    w->stats.nodes += simulation->nodes;
+    ++w->stats.searches;
+    if (result == -1) {
+      ++w->stats.cutoffs;
+    } else {
+      int drawn = size - simulation->min_draw_pile_size;
+      for (int k = hashed + 1; k <= drawn; ++k)
+        keys[k] = cache_mix(keys[k - 1],
+                            simulation->pile[size - k] - simulation->cards);
+      e = &w->cache[keys[drawn] & ((UINT64_C(1) << RESULT_CACHE_BITS) - 1)];
+      e->key = keys[drawn] | 1;
+      e->card_idx = card_idx;
+      e->result = result;
+      e->drawn = drawn;
+      if (drawn > w->max_drawn)
+        w->max_drawn = drawn;
+    }
+  }
+
+  if (result == 0) {
+    ++w->stats.losses;
+    if (card_idx >= 0)
+      ++w->stats.loss_count[card_idx];
+  } else if (result == 1) {
+    ++w->stats.wins;
+    ++w->stats.win_count[card_idx];
+    /* early exit if we certainly play this */
+    if (__atomic_add_fetch(&task->win_count[card_idx], 1, __ATOMIC_RELAXED) >
+        total_simulations / 2)
+      __atomic_store_n(&task->done, 1, __ATOMIC_RELAXED);
+  } else {
+    ++w->stats.unknown_count[card_idx];
+  }
+
+  return result;
+}
+
+static void *simulate(void *arg) {
+  worker *w = arg;
+  simulation_task *task = w->task;
+  game_state *simulation = &w->simulation;
+  int runs = total_simulations;
+  double value[300];
+
+  /* a run searches every root move in paired mode */
+  if (task->paired)
+    runs = (total_simulations + task->paired->num_arms - 1) /
+           task->paired->num_arms;
+
+  clear_stats(&w->stats);
+  memset(w->cache, 0, sizeof(cached_result) << RESULT_CACHE_BITS);
+  w->max_drawn = 0;
+  copy_game_state(task->game, simulation);
+  STAT(clear_search_stats(&simulation->stats));
+
+  while (!__atomic_load_n(&task->done, __ATOMIC_RELAXED)) {
+    int run = __atomic_fetch_add(&task->next_run, 1, __ATOMIC_RELAXED);
+    if (task->deadline > 0
+            ? run >= task->min_runs && now() >= task->deadline
+            : run >= runs)
+      break;
+
+    determinize(simulation, !task->player, &w->rng);
+
+    if (task->paired) {
+      for (int i = 0; i < task->paired->num_arms; ++i) {
+        int result = simulate_move(w, i);
+        value[i] = result == 1 ? 1 : result == -1 ? 0.5 : 0;
+      }
+      if (paired_report(task->paired, value))
+        __atomic_store_n(&task->done, 1, __ATOMIC_RELAXED);
+    } else if (task->scheduler) {
+      int forced_move = scheduler_next(task->scheduler);
+      int result = simulate_move(w, forced_move);
+      if (scheduler_report(task->scheduler, forced_move,
+                           result == 1 ? 1 : result == -1 ? 0.5 : 0))
+        __atomic_store_n(&task->done, 1, __ATOMIC_RELAXED);
+    } else {
+      simulate_move(w, run);
+    }
+  }
+
+  STAT(add_search_stats(&w->stats.search, &simulation->stats));
+
+  return NULL;
+}
+
+/* run the monte carlo simulations of a turn on all workers and sum up; with a
+ * deadline they run until it expires rather than total_simulations times */
+static void simulate_turn(game_state *game, int player, worker *workers,
+                          int num_workers, double deadline,
+                          turn_stats *stats) {
+  simulation_task task = {.game = game, .player = player, .deadline = deadline};
+
+  move moves[MAX_MOVES];
+  int legal_moves = generate_moves(game, player, moves, 0);
+
+  /* the deadline does not stop the runs that simulate every move once */
+  task.min_runs = paired_mode ? 1 : legal_moves;
+  task.legal_moves = legal_moves;
+
+  scheduler q;
+  paired_stats p;
+  if (legal_moves > 0 && paired_mode) {
+    paired_init(&p, legal_moves, adaptive_delta);
+    task.paired = &p;
+  } else if (legal_moves > 0 && adaptive_delta > 0) {
+    scheduler_init(&q, legal_moves, adaptive_delta);
+    task.scheduler = &q;
+  }
+
+  for (int i = 0; i < num_workers; ++i)
+    workers[i].task = &task;
+
+  /* the calling thread acts as the first worker */
+  for (int i = 1; i < num_workers; ++i) {
+    if (pthread_create(&workers[i].thread, NULL, simulate, &workers[i]) != 0) {
+      fprintf(stderr, "failed to create thread\n");
+      exit(1);
+    }
+  }
+  simulate(&workers[0]);
+  for (int i = 1; i < num_workers; ++i)
+    pthread_join(workers[i].thread, NULL);
+
+  for (int i = 0; i < num_workers; ++i)
+    add_stats(stats, &workers[i].stats);
+
+  if (task.scheduler)
+    pthread_mutex_destroy(&q.lock);
+
+  if (task.paired) {
+    int best, second;
+    paired_best(&p, &best, &second);
+    if (second != -1 && p.samples > 1) {
+      double paired = paired_variance(&p, best, second);
+      double independent =
+          marginal_variance(&p, best) + marginal_variance(&p, second);
+      if (paired > 0)
+        stats->paired_gain = independent / paired;
+    }
+    paired_free(&p);
+  }
+}
+
+/* parallel search of the perfect information endgame. both players
+ * cooperate, so a position is won as soon as one move wins: the tree is split
+ * into tasks of the positions ENDGAME_SPLIT_DEPTH moves deep, which are
+ * searched by play() on a copy of the game per worker. tasks are expanded
+ * best-first on the worker's own deque and idle workers steal the oldest
+ * task of another worker. the first win cancels all other tasks. */
+#define ENDGAME_SPLIT_DEPTH 2
+
+typedef struct endgame_task {
+  uint8_t depth;
+  uint8_t player;       /* to move after the moves */
+  uint8_t moves[ENDGAME_SPLIT_DEPTH][3]; /* hand, extra (or 36) and player */
+} endgame_task;
+
+typedef struct task_deque {
+  pthread_mutex_t lock;
+  int top;    /* other workers steal here */
+  int bottom; /* the owner pushes and pops here */
+  endgame_task tasks[300 * ENDGAME_SPLIT_DEPTH];
+} task_deque;
+
+typedef struct endgame_search {
+  packed_state root;
+  worker *workers;
+  task_deque *deques;
+  int num_workers;
+  int pending; /* tasks pushed but not finished */
+  int won;     /* cancels the other tasks once set */
+  int expired; /* a task ran into the deadline */
+  int move_idx;
+  double deadline;
+} endgame_search;
+
+typedef struct endgame_worker {
+  pthread_t thread;
+  endgame_search *search;
+  int id;
+  uint64_t nodes;
+} endgame_worker;
+
+static void push_task(endgame_search *e, int id, endgame_task *task) {
+  task_deque *d = &e->deques[id];
+  __atomic_add_fetch(&e->pending, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&d->lock);
+  d->tasks[d->bottom++] = *task;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/* pop from the own deque, or else steal from another one */
+static int pop_task(endgame_search *e, int id, endgame_task *task) {
+  for (int i = 0; i < e->num_workers; ++i) {
+    int victim = (id + i) % e->num_workers;
+    task_deque *d = &e->deques[victim];
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->top < d->bottom) {
+      *task = victim == id ? d->tasks[--d->bottom] : d->tasks[d->top++];
+      found = 1;
+      if (d->top == d->bottom)
+        d->top = d->bottom = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (found)
+      return 1;
+  }
+  return 0;
+}
+
+static void run_task(endgame_worker *ew, endgame_task *task) {
+  endgame_search *e = ew->search;
+  game_state *s = &e->workers[ew->id].simulation;
+
+  unpack_state(&e->root, s);
+  for (int i = 0; i < task->depth; ++i)
+    play_move(s, task->moves[i][2],
+              idx_to_move(s, task->moves[i][0] * 37 + task->moves[i][1]));
+
+  int player = task->player;
+  int result = -1;
+
+  if (s->pile_count >= s->max_piles) {
+    result = 0;
+  } else {
+    /* no cards to play, skip to next player */
+    if (s->hands[player] == NULL)
+      player = !player;
+    /* both players are done, game is won */
+    if (s->hands[player] == NULL)
+      result = 1;
+  }
+
+  if (result == -1 && task->depth == ENDGAME_SPLIT_DEPTH) {
+    s->nodes = 0;
+    s->depth = task->depth;
+    s->key = state_key(s);
+    s->cancel = &e->won;
+    s->deadline = e->deadline;
+    result = play(s, player, -1, -1);
+    s->cancel = NULL;
+    s->deadline = 0;
+    s->depth = 0;
+    ew->nodes += s->nodes;
+    /* out of time, or cancelled by a win */
+    if (result == -1)
+      __atomic_store_n(&e->expired, 1, __ATOMIC_SEQ_CST);
+  } else if (result == -1) {
+    /* split: push the moves in reverse so that the best is popped first */
+    move moves[MAX_MOVES];
+    int legal_moves = generate_moves(s, player, moves, 1);
+    order_moves(s, moves, legal_moves);
+    /* the move to play if time runs out before a win is found */
+    if (task->depth == 0 && legal_moves > 0)
+      e->move_idx = move_to_idx(s, moves[0]);
+    for (int i = legal_moves - 1; i >= 0; --i) {
+      endgame_task child = *task;
+      int idx = move_to_idx(s, moves[i]);
+      child.moves[task->depth][0] = idx / 37;
+      child.moves[task->depth][1] = idx % 37;
+      child.moves[task->depth][2] = player;
+      child.depth = task->depth + 1;
+      child.player = !player;
+      push_task(e, ew->id, &child);
+    }
+    ++ew->nodes;
+  }
+
+  /* the first win decides the root move */
+  if (result == 1) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&e->won, &expected, 1, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) &&
+        task->depth > 0)
+      e->move_idx = task->moves[0][0] * 37 + task->moves[0][1];
+  }
+}
+
+static void *endgame_work(void *arg) {
+  endgame_worker *ew = arg;
+  endgame_search *e = ew->search;
+  endgame_task task;
+
+  while (!__atomic_load_n(&e->won, __ATOMIC_SEQ_CST)) {
+    if (e->deadline > 0 && now() >= e->deadline) {
+      __atomic_store_n(&e->expired, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+    if (pop_task(e, ew->id, &task)) {
+      run_task(ew, &task);
+      __atomic_sub_fetch(&e->pending, 1, __ATOMIC_SEQ_CST);
+    } else if (__atomic_load_n(&e->pending, __ATOMIC_SEQ_CST) == 0) {
+      break;
+    } else {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+/* search the endgame on all workers like play(s, player, 0, -1, -1); the
+ * winning root move is stored in *move_idx, but may differ from the one of
+ * play() if there are several. returns -1 and the first move in best-first
+ * order if the deadline expires first */
+static int solve_endgame(game_state *root, int player, worker *workers,
+                         int num_workers, double deadline, int *move_idx,
+                         uint64_t *nodes) {
+  endgame_search e = {.workers = workers,
+                      .num_workers = num_workers,
+                      .pending = 0,
+                      .won = 0,
+                      .expired = 0,
+                      .move_idx = -1,
+                      .deadline = deadline};
+  endgame_worker *ew = malloc(num_workers * sizeof(endgame_worker));
+  e.deques = malloc(num_workers * sizeof(task_deque));
+  if (ew == NULL || e.deques == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < num_workers; ++i) {
+    pthread_mutex_init(&e.deques[i].lock, NULL);
+    e.deques[i].top = e.deques[i].bottom = 0;
+    ew[i].search = &e;
+    ew[i].id = i;
+    ew[i].nodes = 0;
+  }
+
+  pack_state(root, &e.root);
+  endgame_task task = {.depth = 0, .player = player};
+  push_task(&e, 0, &task);
+
+  /* the calling thread acts as the first worker */
+  for (int i = 1; i < num_workers; ++i) {
+    if (pthread_create(&ew[i].thread, NULL, endgame_work, &ew[i]) != 0) {
+      fprintf(stderr, "failed to create thread\n");
+      exit(1);
+    }
+  }
+  endgame_work(&ew[0]);
+  for (int i = 1; i < num_workers; ++i)
+    pthread_join(ew[i].thread, NULL);
+
+  *nodes = 0;
+  for (int i = 0; i < num_workers; ++i) {
+    *nodes += ew[i].nodes;
+    pthread_mutex_destroy(&e.deques[i].lock);
+  }
+  free(e.deques);
+  free(ew);
+
+  *move_idx = e.move_idx;
+  return e.won ? 1 : e.expired ? -1 : 0;
+}
+
+/* workers and buffers that are reused between turns */
+typedef struct agent {
+  worker *workers;
+  int num_workers;
+  game_state simulation; /* for the perfect information endgame */
+  turn_stats stats;
+  uint64_t *proven; /* shared by all searches, see proven_store() */
+} agent;
+
+/* reseed the workers and forget all results, so that a game played after
+ * this depends on the seed only */
+static void agent_seed(agent *a, rng *seed) {
+  /* every worker gets its own random stream */
+  rng stream = *seed;
+  for (int i = 0; i < a->num_workers; ++i) {
+    random_jump(&stream);
+    a->workers[i].rng = stream;
+    memset(a->workers[i].simulation.tt, 0,
+           sizeof(uint64_t) << TT_BITS);
+  }
+  memset(a->simulation.tt, 0, sizeof(uint64_t) << TT_BITS);
+  memset(a->proven, 0, sizeof(uint64_t) << TT_BITS);
+}
+
+static agent *agent_alloc(int num_workers, rng *seed) {
+  agent *a = malloc(sizeof(agent));
+  worker *workers = malloc(num_workers * sizeof(worker));
+  if (a == NULL || workers == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < num_workers; ++i) {
+    init_state(&workers[i].simulation);
+    workers[i].simulation.tt = tt_alloc();
+    workers[i].cache = malloc(sizeof(cached_result) << RESULT_CACHE_BITS);
+    if (workers[i].cache == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+
+  a->workers = workers;
+  a->num_workers = num_workers;
+  init_state(&a->simulation);
+  a->simulation.tt = tt_alloc();
+  a->proven = tt_alloc();
+  for (int i = 0; i < num_workers; ++i)
+    workers[i].simulation.proven = a->proven;
+  a->simulation.proven = a->proven;
+  agent_seed(a, seed);
+  return a;
+}
+
+static void agent_free(agent *a) {
+  for (int i = 0; i < a->num_workers; ++i) {
+    free(a->workers[i].simulation.tt);
+    free(a->workers[i].cache);
+  }
+  free(a->simulation.tt);
+  free(a->proven);
+  free(a->workers);
+  free(a);
+}
+
+/* opening book, see -O and -B: the best first moves of the hands that can be
+ * dealt, found offline with BOOK_SIMULATIONS simulations each. an entry is
+ * the pile limit and the hand as a mask of cards, color shifted to the
+ * smallest of its six shifts (see the zobrist keys), above the move in 11
+ * bits. the entries are sorted, so that a mapped book is searched in place */
+#define BOOK_MAGIC "BRNB"
+#define BOOK_VERSION 1
+#define BOOK_SIMULATIONS (10 * TOTAL_SIMULATIONS)
+#define BOOK_MOVE_BITS 11
+
+typedef struct book_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t num_entries;
+} book_header;
+
+/* the book given with -O, or NULL */
+static const uint64_t *book = NULL;
+static uint64_t book_entries = 0;
+
+/* move idx with its cards shifted by one color, see shift_card() */
+static int shift_move(int idx) {
+  int extra = idx % 37;
+  return shift_card(idx / 37) * 37 + (extra == 36 ? 36 : shift_card(extra));
+}
+
+/* the book key of hand, and in *shift how many shifts by one color give it */
+static uint64_t book_key(uint64_t hand, int max_piles, int *shift) {
+  uint64_t best = hand;
+  *shift = 0;
+  for (int k = 1; k < 6; ++k) {
+    uint64_t shifted = 0;
+    for (uint64_t h = hand; h; h &= h - 1)
+      shifted |= UINT64_C(1) << shift_card(__builtin_ctzll(h));
+    hand = shifted;
+    if (hand < best) {
+      best = hand;
+      *shift = k;
+    }
+  }
+  return (uint64_t)max_piles << 36 | best;
+}
+
+/* the entry of key in the sorted entries, or -1 */
+static int64_t book_find(const uint64_t *entries, uint64_t num_entries,
+                         uint64_t key) {
+  uint64_t lo = 0, hi = num_entries;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (entries[mid] >> BOOK_MOVE_BITS < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < num_entries && entries[lo] >> BOOK_MOVE_BITS == key
+             ? (int64_t)lo
+             : -1;
+}
+
+/* the book move of player if no card was played yet, or -1 */
+static int book_move(game_state *game, int player) {
+  if (book == NULL || game->pile_count != 0 || game->cards_left != 36 ||
+      game->draw_pile_size != 36 - 2 * NUM_START)
+    return -1;
+
+  uint64_t hand = 0;
+  for (card *c = game->hands[player]; c; c = c->down)
+    hand |= UINT64_C(1) << (c - game->cards);
+  int shift;
+  int64_t i = book_find(book, book_entries,
+                        book_key(hand, game->max_piles, &shift));
+  if (i == -1)
+    return -1;
+  /* shift the move of the key back to the hand */
+  int idx = book[i] & ((1 << BOOK_MOVE_BITS) - 1);
+  for (int k = shift; k > 0 && k < 6; ++k)
+    idx = shift_move(idx);
+  return idx;
+}
+
+/* map the book at path; returns its entries or NULL */
+static const uint64_t *map_book(const char *path, uint64_t *num_entries) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(path);
+    return NULL;
+  }
+  const book_header *h =
+      st.st_size >= (off_t)sizeof(book_header)
+          ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+          : MAP_FAILED;
+  close(fd);
+  if (h == MAP_FAILED || memcmp(h->magic, BOOK_MAGIC, 4) != 0 ||
+      h->version != BOOK_VERSION ||
+      (uint64_t)st.st_size !=
+          sizeof(book_header) + h->num_entries * sizeof(uint64_t)) {
+    fprintf(stderr, "%s: not an opening book\n", path);
+    return NULL;
+  }
+  *num_entries = h->num_entries;
+  return (const uint64_t *)(h + 1);
+}
+
+/* time per turn in seconds, or 0 for a fixed number of simulations */
+static double turn_budget = 0;
+
+/* search the best move of a turn and print the candidates to out if not
+ * NULL; returns the move index or -1 if no win was found */
+static int play_turn(agent *a, game_state *game, int player, FILE *out) {
+  turn_stats *stats = &a->stats;
+  double deadline = turn_budget > 0 ? now() + turn_budget : 0;
+
+  clear_stats(stats);
+
+  int book_idx = book_move(game, player);
+  if (book_idx >= 0) {
+    ++stats->win_count[book_idx];
+  } else if (game->draw_pile_size == 0) {
+    /* if there are no cards to draw we have perfect information: no need
+     * for monte carlo */
+    copy_game_state(game, &a->simulation);
+    STAT(clear_search_stats(&a->simulation.stats));
+
+    int card_idx;
+    int result;
+    /* the line of a win proven in an earlier turn */
+    uint64_t key = state_key(game).shifted[0] ^ (player ? zobrist_player : 0);
+    int proven = proven_probe(a->proven, key, &card_idx) == 1;
+    if (proven) {
+      result = 1;
+      ++stats->proven_hits;
+    } else if (engine == POINTER_ENGINE && a->num_workers > 1) {
+      uint64_t nodes;
+      for (int i = 0; i < a->num_workers; ++i)
+        STAT(clear_search_stats(&a->workers[i].simulation.stats));
+      result = solve_endgame(game, player, a->workers, a->num_workers,
+                             deadline, &card_idx, &nodes);
+      stats->nodes += nodes;
+      /* the workers searched, like in simulate() */
+      for (int i = 0; i < a->num_workers; ++i)
+        STAT(add_search_stats(&stats->search,
+                              &a->workers[i].simulation.stats));
+    } else {
+      a->simulation.deadline = deadline;
+      result = search(&a->simulation, player, -1, -1, &card_idx);
+      stats->nodes += a->simulation.nodes;
+    }
+
+    if (!proven)
+      ++stats->searches;
+    STAT(add_search_stats(&stats->search, &a->simulation.stats));
+
+    if (result == 1) {
+      ++stats->win_count[card_idx];
+    } else if (result == 0) {
+      ++stats->losses;
+    } else {
+      /* out of time: play the move that was being searched */
+      ++stats->cutoffs;
+      if (card_idx >= 0)
+        ++stats->unknown_count[card_idx];
+    }
+  } else {
+    simulate_turn(game, player, a->workers, a->num_workers, deadline, stats);
+  }
+
+  int best_move = 0;
+  int best_move_idx = -1;
+  for (int i = 0; i < 36 * 37; ++i) {
+    /* assume that no solution found is 50% chance of winning */
+    int win_factor = 2 * stats->win_count[i] + stats->unknown_count[i];
+    if (win_factor > best_move) {
+      best_move = win_factor;
+      best_move_idx = i;
+    }
+  }
+
+  if (out == NULL)
+    return best_move_idx;
+
+  fprintf(out, "losses = %d. wins = %d\n", stats->losses, stats->wins);
+
+  for (int i = 0; i < 36 * 37; ++i) {
+    if (stats->win_count[i] == 0 && stats->unknown_count[i] == 0)
+      continue;
+    saved_move mi = idx_to_move(game, i);
+    print_card(out, mi.hand, 0);
+    if (mi.extra) {
+      fprintf(out, " ");
+      print_card(out, mi.extra, 0);
+    }
+    fprintf(out, "\n");
+    int win_factor = 2 * stats->win_count[i] + stats->unknown_count[i];
+    for (int j = 0; j < (70.0 * win_factor) / best_move; ++j)
+      fprintf(out, "*");
+    fprintf(out, " (%d)", win_factor);
+    if (i == best_move_idx)
+      fprintf(out, " !!");
+    fprintf(out, "\n");
+  }
+
+  if (best_move_idx == -1)
+    fprintf(out, "no win found\n");
+
+  return best_move_idx;
+}
+
+/* ndjson log with a record for every turn played, see -l; NULL if off */
+static FILE *turn_log = NULL;
+#define TURN_LOG_BUFFER (1 << 20)
+
+/* write cards of mask to p separated by commas; returns the end */
+static char *format_cards(char *p, uint64_t mask) {
+  for (uint64_t m = mask; m; m &= m - 1)
+    p += sprintf(p, m == mask ? "%d" : ",%d", __builtin_ctzll(m));
+  return p;
+}
+
+/* the position as player sees it, in the format of the advisor, see
+ * parse_position(); returns the end */
+static char *format_position(char *p, game_state *game, int player) {
+  uint64_t other = 0, hidden = 0, draw = 0;
+  for (card *c = game->hands[!player]; c; c = c->down)
+    if (c->visible)
+      other |= UINT64_C(1) << (c - game->cards);
+    else
+      hidden |= UINT64_C(1) << (c - game->cards);
+  for (int i = 0; i < game->draw_pile_size; ++i)
+    draw |= UINT64_C(1) << (game->pile[i] - game->cards);
+
+  p += sprintf(p, "hand=");
+  for (card *c = game->hands[player]; c; c = c->down)
+    p += sprintf(p, c == game->hands[player] ? "%d" : ",%d",
+                 (int)(c - game->cards));
+  p += sprintf(p, " other=");
+  p = format_cards(p, other);
+  p += sprintf(p, " hidden=%d table=", __builtin_popcountll(hidden));
+  for (card *t = game->table; t; t = t->right)
+    for (card *c = t; c; c = c->down)
+      p += sprintf(p, c != t ? ".%d" : t != game->table ? ",%d" : "%d",
+                   (int)(c - game->cards));
+  p += sprintf(p, " unknown=");
+  p = format_cards(p, hidden | draw);
+  return p + sprintf(p, " piles=%d", game->max_piles);
+}
+
+/* log turn of game g in which the search of player chose move_idx in the
+ * given seconds, and the move played before if it is replayed (or -1), with
+ * one write so that threads can share the log */
+static void log_turn(int g, int turn, game_state *game, int player,
+                     turn_stats *t, int move_idx, int played,
+                     double seconds) {
+  /* less than 96 bytes per move */
+  char record[MAX_MOVES * 96 + 1024], *p = record;
+
+  p += sprintf(p, "{\"game\":%d,\"turn\":%d,\"player\":%d,\"position\":\"", g,
+               turn, player);
+  p = format_position(p, game, player);
+  p += sprintf(p, "\",\"moves\":[");
+  int first = 1;
+  for (int i = 0; i < 36 * 37 && p - record < MAX_MOVES * 96; ++i) {
+    if (t->win_count[i] == 0 && t->loss_count[i] == 0 &&
+        t->unknown_count[i] == 0)
+      continue;
+    p += sprintf(p, "%s{\"move\":%d,\"wins\":%d,\"losses\":%d,\"unknown\":%d}",
+                 first ? "" : ",", i, t->win_count[i], t->loss_count[i],
+                 t->unknown_count[i]);
+    first = 0;
+  }
+  p += sprintf(p, "],\"move\":%d,", move_idx);
+  if (played >= 0)
+    p += sprintf(p, "\"played\":%d,", played);
+  p += sprintf(p, "\"nodes\":%" PRIu64 ",\"searches\":%d,\"ms\":%.3f}\n",
+               t->nodes, t->searches, 1e3 * seconds);
+  fwrite(record, 1, p - record, turn_log);
+}
+
+/* binary game records, see -r and -R: a header and fixed size records, so
+ * that record i of a mapped file is found directly */
+#define RECORD_MAGIC "BRNR"
+#define RECORD_VERSION 1
+#define RECORD_MAX_MOVES 96
+
+typedef struct record_header {
+  char magic[4];
+  uint16_t version;
+  uint16_t record_size;
+} record_header;
+
+typedef struct game_record {
+  uint32_t index;    /* of the game, see play_game() */
+  uint8_t deck[36];  /* game_state.pile as dealt from, see deal() */
+  uint8_t max_piles;
+  uint8_t num_moves; /* up to RECORD_MAX_MOVES; longer games are cut */
+  uint8_t won;
+  uint8_t cut;       /* 1 if there were more moves */
+  uint16_t moves[RECORD_MAX_MOVES]; /* hand * 37 + (extra or 36) per turn */
+} game_record;
+
+/* the records of the games played, see -r; NULL if off */
+static FILE *game_records = NULL;
+
+/* play game number g to the end and print it to out if not NULL; returns 1
+ * if won */
+static int play_game(agent *a, game_state *game, int g, FILE *out) {
+#ifdef SEARCH_STATS
+  search_stats total;
+  clear_search_stats(&total);
+#endif
+
+  if (out)
+    fprintf(out, "\n\nGAME %d\n", g);
+
+  game_record record = {.index = g,
+                        .max_piles = game->max_piles,
+                        .num_moves = 0,
+                        .cut = 0};
+  for (int i = 0; i < 36; ++i)
+    record.deck[i] = game->pile[i] - game->cards;
+
+  int won = 0;
+  int player = 0;
+  for (int turn = 0;; ++turn) {
+    if (out)
+      print_state(out, game, 1);
+
+    /* determine if there are any cards to play */
+    if (!game->hands[player])
+      player = !player;
+
+    if (!game->hands[player]) {
+      won = 1;
+      break;
+    }
+
+    if (out)
+      fprintf(out, "\n\nTURN %d (player %d)\n", turn, player + 1);
+
+    double start = now();
+    int best_move_idx = play_turn(a, game, player, out);
+    if (turn_log)
+      log_turn(g, turn, game, player, &a->stats, best_move_idx, -1,
+               now() - start);
+
+    STAT(print_search_stats(stderr, g, turn, &a->stats.search));
+    STAT(add_search_stats(&total, &a->stats.search));
+
+    if (best_move_idx == -1)
+      break;
+
+    if (record.num_moves < RECORD_MAX_MOVES)
+      record.moves[record.num_moves++] = best_move_idx;
+    else
+      record.cut = 1;
+    play_move(game, player, idx_to_move(game, best_move_idx));
+
+    /* next player */
+    player = !player;
+  }
+
+  STAT(print_search_stats(stderr, g, -1, &total));
+
+  /* one write, so that threads can share the file */
+  record.won = won;
+  if (game_records)
+    fwrite(&record, sizeof(record), 1, game_records);
+
+  return won;
+}
+
+#define CHECK_MAX_NODES 20000
+
+/* a random legal move, or -1 if there is none */
+static int random_move(game_state *game, game_state *scratch, int player,
+                       rng *r) {
+  int idx;
+  copy_game_state(game, scratch);
+  search(scratch, player, 2, random_next(r) % 300, &idx);
+  return idx;
+}
+
+#define CHECK_THREADS 4
+#define CHECK_SLICE_NODES 1000
+
+/* pseudo engine of check_engines(): the pointer engine with reduce_moves off */
+#define FULL 2
+
+/* the parallel endgame search of game must agree with the sequential
+ * result, and its winning move must win as well; returns 1 if not */
+static int check_endgame(game_state *game, game_state *scratch, int player,
+                         agent *pool, int sequential, int g, int turn) {
+  /* see run_task(); a game that is over has no move to check */
+  if (game->hands[player] == NULL)
+    player = !player;
+  if (game->hands[player] == NULL || game->pile_count >= game->max_piles)
+    return 0;
+
+  int parallel_idx;
+  uint64_t parallel_nodes;
+  int parallel = solve_endgame(game, player, pool->workers, CHECK_THREADS, 0,
+                               &parallel_idx, &parallel_nodes);
+  if (parallel == 1) {
+    copy_game_state(game, scratch);
+    play_move(scratch, player, idx_to_move(scratch, parallel_idx));
+    int dummy;
+    parallel = search(scratch, !player, UINT64_MAX, -1, &dummy);
+  }
+  if (parallel == sequential)
+    return 0;
+  printf("mismatch in game %d turn %d: sequential %d, parallel %d\n", g, turn,
+         sequential, parallel);
+  print_state(stdout, game, 1);
+  return 1;
+}
+
+/* a position of whole color orbits of cards is its own color shift, so the
+ * keys of two of them differ by the keys of whole orbits only. those of the
+ * positions with every action in a hand or discarded must all differ;
+ * returns the number of collisions */
+static int check_orbit_keys(void) {
+  game_state *s = state_alloc();
+  uint64_t keys[729];
+  for (int i = 0; i < 729; ++i) {
+    init_state(s);
+    s->draw_pile_size = 0;
+    for (int action = 0, x = i; action < 6; ++action, x /= 3) {
+      if (x % 3 == 2)
+        continue;
+      for (int c = 6 * action; c < 6 * action + 6; ++c) {
+        s->cards[c].down = s->hands[x % 3];
+        s->hands[x % 3] = &s->cards[c];
+      }
+    }
+    zobrist_key key = state_key(s);
+    keys[i] = canonical_key(&key);
+  }
+  qsort(keys, 729, sizeof(uint64_t), compare_entries);
+  int collisions = 0;
+  for (int i = 1; i < 729; ++i)
+    collisions += keys[i] == keys[i - 1];
+  if (collisions)
+    printf("mismatch: %d collisions of the keys of color orbits\n",
+           collisions);
+  free(s);
+  return collisions;
+}
+
+/* play seeded games and compare the search results of both engines with open
+ * cards in every turn, and those of the parallel endgame search with the
+ * sequential one; returns the number of mismatches */
+static int check_engines(int num_games) {
+  static char *engine_str[] = {"pointer", "bitboard", "full"};
+  rng r = game_rng;
+  game_state *game = state_alloc(), *copy = state_alloc(),
+             *full = state_alloc(), *sliced = state_alloc();
+  uint64_t nodes[3] = {0, 0, 0};
+  double seconds[3] = {0, 0, 0};
+  int positions = 0, compared = 0, mismatches = 0, resumes = 0;
+
+  copy->tt = tt_alloc();
+  full->tt = tt_alloc();
+  sliced->tt = tt_alloc();
+
+  rng seed = game_rng;
+  random_jump(&seed);
+  agent *pool = agent_alloc(CHECK_THREADS, &seed);
+  int endgames = 0, lost_endgames = 0, shuffled = 0;
+  /* random moves off the line of the games */
+  rng branch = seed;
+  random_jump(&branch);
+
+  for (int g = 0; g < num_games; ++g) {
+    random_init(game, &r);
+
+    for (int turn = 0, player = 0; game->pile_count < game->max_piles; ++turn) {
+      if (!game->hands[player])
+        player = !player;
+      if (!game->hands[player])
+        break;
+
+      /* the endgame is searched exhaustively, like in the actual game */
+      uint64_t max_nodes = game->draw_pile_size == 0 ? UINT64_MAX
+                                                      : CHECK_MAX_NODES;
+      int result[3], move_idx[3];
+      for (int e = POINTER_ENGINE; e <= BITBOARD_ENGINE; ++e) {
+        engine = e;
+        copy_game_state(game, copy);
+        double start = now();
+        result[e] = search(copy, player, max_nodes, -1, &move_idx[e]);
+        seconds[e] += now() - start;
+        nodes[e] += copy->nodes;
+      }
+      engine = POINTER_ENGINE;
+
+      /* the pointer engine without skipping equivalent moves, with a table
+       * of its own so that it shares no results with the other searches */
+      reduce_moves = 0;
+      copy_game_state(game, full);
+      double start = now();
+      result[FULL] = search(full, player, max_nodes, -1, &move_idx[FULL]);
+      seconds[FULL] += now() - start;
+      nodes[FULL] += full->nodes;
+      reduce_moves = 1;
+
+      /* the default engine once more, unpacked from a snapshot and stopped
+       * and resumed every CHECK_SLICE_NODES nodes, must come back to the
+       * same snapshot */
+      packed_state before, after;
+      memset(&before, 0, sizeof(packed_state));
+      memset(&after, 0, sizeof(packed_state));
+      pack_state(game, &before);
+      before.key = state_key(game);
+      unpack_state(&before, sliced);
+      sliced->nodes = 0;
+      search_start(sliced, player, -1);
+      int resumed;
+      uint64_t budget = 0;
+      do {
+        budget = max_nodes - budget > CHECK_SLICE_NODES
+                     ? budget + CHECK_SLICE_NODES
+                     : max_nodes;
+        resumed = search_resume(sliced, budget);
+        ++resumes;
+      } while (resumed == -1 && budget < max_nodes);
+      if (resumed == -1)
+        search_abort(sliced);
+      pack_state(sliced, &after);
+      if ((resumed != -1 && result[POINTER_ENGINE] != -1 &&
+           resumed != result[POINTER_ENGINE]) ||
+          memcmp(&before, &after, sizeof(packed_state)) != 0) {
+        ++mismatches;
+        printf("mismatch in game %d turn %d: pointer %d, resumed %d\n", g,
+               turn, result[POINTER_ENGINE], resumed);
+        print_state(stdout, game, 1);
+      }
+
+      /* a simulation caches its result keyed on the cards it drew only, so
+       * shuffling the rest of the draw pile must not change it */
+      if (game->draw_pile_size > 0) {
+        int forced_move = random_next(&branch) % 300, idx_cached, idx_fresh;
+        copy_game_state(game, copy);
+        int cached = search(copy, player, MAX_NODES_PER_SIMULATION,
+                            forced_move, &idx_cached);
+        if (cached != -1) {
+          copy_game_state(game, full);
+          for (int i = 0; i < copy->min_draw_pile_size; ++i) {
+            int j = i + random_next(&branch) % (copy->min_draw_pile_size - i);
+            card *tmp = full->pile[j];
+            full->pile[j] = full->pile[i];
+            full->pile[i] = tmp;
+          }
+          memset(full->tt, 0, sizeof(uint64_t) << TT_BITS);
+          int fresh = search(full, player, MAX_NODES_PER_SIMULATION,
+                             forced_move, &idx_fresh);
+          if (fresh != -1) {
+            ++shuffled;
+            if (fresh != cached || idx_fresh != idx_cached) {
+              ++mismatches;
+              printf("mismatch in game %d turn %d: cached %d, shuffled %d\n",
+                     g, turn, cached, fresh);
+              print_state(stdout, game, 1);
+            }
+          }
+        }
+      }
+
+      if (game->draw_pile_size == 0) {
+        mismatches += check_endgame(game, copy, player, pool,
+                                    result[POINTER_ENGINE], g, turn);
+        ++endgames;
+        lost_endgames += result[POINTER_ENGINE] == 0;
+
+        /* the games below follow wins, so also check the position after a
+         * random move, which often loses */
+        int idx = random_move(game, copy, player, &branch);
+        if (idx >= 0) {
+          int dummy;
+          copy_game_state(game, full);
+          play_move(full, player, idx_to_move(full, idx));
+          int sequential = search(full, !player, UINT64_MAX, -1, &dummy);
+          mismatches +=
+              check_endgame(full, copy, !player, pool, sequential, g, turn);
+          ++endgames;
+          lost_endgames += sequential == 0;
+        }
+      }
+
+      ++positions;
+      if (result[POINTER_ENGINE] != -1 && result[BITBOARD_ENGINE] != -1) {
+        ++compared;
+        if (result[POINTER_ENGINE] != result[BITBOARD_ENGINE]) {
+          ++mismatches;
+          printf("mismatch in game %d turn %d: pointer %d, bitboard %d\n", g,
+                 turn, result[POINTER_ENGINE], result[BITBOARD_ENGINE]);
+          print_state(stdout, game, 1);
+        }
+      }
+      if (result[POINTER_ENGINE] != -1 && result[FULL] != -1 &&
+          result[POINTER_ENGINE] != result[FULL]) {
+        ++mismatches;
+        printf("mismatch in game %d turn %d: reduced %d, full %d\n", g, turn,
+               result[POINTER_ENGINE], result[FULL]);
+        print_state(stdout, game, 1);
+      }
+
+      /* follow a winning line if there is one, otherwise play randomly */
+      int idx = move_idx[POINTER_ENGINE];
+      if (result[POINTER_ENGINE] != 1)
+        idx = random_move(game, copy, player, &r);
+      if (idx < 0)
+        break;
+
+      play_move(game, player, idx_to_move(game, idx));
+      player = !player;
+    }
+  }
+
+  mismatches += check_orbit_keys();
+
+  printf("positions = %d. compared = %d. endgames = %d (%d lost). "
+         "shuffled = %d. resumes = %d. mismatches = %d\n",
+         positions, compared, endgames, lost_endgames, shuffled, resumes,
+         mismatches);
+  for (int e = POINTER_ENGINE; e <= FULL; ++e)
+    printf("%-8s: %" PRIu64 " nodes in %.3fs, %.0f nodes/sec\n",
+           engine_str[e], nodes[e], seconds[e], nodes[e] / seconds[e]);
+
+  agent_free(pool);
+  free(copy->tt);
+  free(full->tt);
+  free(sliced->tt);
+  free(game);
+  free(copy);
+  free(full);
+  free(sliced);
+
+  return mismatches;
+}
+
+#define BENCH_MIDGAME_TURNS 6
+#define BENCH_LINE_NODES 1000
+
+typedef struct bench_stats {
+  double *turn_seconds; /* time of every turn */
+  int turns;
+  int capacity;
+  uint64_t nodes;
+  uint64_t searches;
+  uint64_t cutoffs;
+  uint64_t cache_hits;
+  uint64_t proven_hits;
+  double paired_gain; /* sum over the turns where it is known */
+  int paired_turns;
+  int games;
+  int won;
+} bench_stats;
+
+static void bench_turn(bench_stats *b, turn_stats *t, double seconds) {
+  if (b->turns == b->capacity) {
+    b->capacity = b->capacity ? 2 * b->capacity : 256;
+    b->turn_seconds =
+        realloc(b->turn_seconds, b->capacity * sizeof(*b->turn_seconds));
+    if (b->turn_seconds == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  b->turn_seconds[b->turns++] = seconds;
+  b->nodes += t->nodes;
+  b->searches += t->searches;
+  b->cutoffs += t->cutoffs;
+  b->cache_hits += t->cache_hits;
+  b->proven_hits += t->proven_hits;
+  if (t->paired_gain > 0) {
+    b->paired_gain += t->paired_gain;
+    ++b->paired_turns;
+  }
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* nearest rank percentile of sorted values */
+static double percentile(double *sorted, int n, double p) {
+  if (n == 0)
+    return 0;
+  int rank = (int)ceil(p * n);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* 95% wilson score interval of a fraction k / n */
+static void wilson_interval(int k, int n, double *lo, double *hi) {
+  double z = 1.96, p = (double)k / n;
+  double center = (p + z * z / (2 * n)) / (1 + z * z / n);
+  double half = z * sqrt(p * (1 - p) / n + z * z / (4.0 * n * n)) /
+                (1 + z * z / n);
+  *lo = center - half;
+  *hi = center + half;
+}
+
+/* json fields of a win rate with its confidence interval */
+static void print_win_rate(FILE *stream, int won, int games) {
+  double lo, hi;
+  wilson_interval(won, games, &lo, &hi);
+  fprintf(stream,
+          "\"games\":%d,\"won\":%d,\"win_rate\":%.4f,"
+          "\"win_rate_ci95\":[%.4f,%.4f]",
+          games, won, (double)won / games, lo, hi);
+}
+
+static void bench_report(FILE *stream, char *name, int threads,
+                         bench_stats *b) {
+  double seconds = 0;
+  for (int i = 0; i < b->turns; ++i)
+    seconds += b->turn_seconds[i];
+  qsort(b->turn_seconds, b->turns, sizeof(double), compare_double);
+
+  fprintf(stream,
+          "{\"bench\":\"%s\",\"max_piles\":%d,\"max_nodes\":%d,"
+          "\"simulations\":%d,\"engine\":\"%s\",\"threads\":%d,"
+          "\"turns\":%d,"
+          "\"nodes\":%" PRIu64 ",\"nodes_per_sec\":%.0f,"
+          "\"turn_ms_p50\":%.3f,\"turn_ms_p99\":%.3f,"
+          "\"searches\":%" PRIu64 ",\"cutoff_fraction\":%.4f,"
+          "\"cache_hit_fraction\":%.4f,\"proven_hit_fraction\":%.4f",
+          name, difficulty, MAX_NODES_PER_SIMULATION, total_simulations,
+          engine == BITBOARD_ENGINE ? "bitboard" : "pointer", threads,
+          b->turns,
+          b->nodes, seconds > 0 ? b->nodes / seconds : 0,
+          1e3 * percentile(b->turn_seconds, b->turns, 0.5),
+          1e3 * percentile(b->turn_seconds, b->turns, 0.99), b->searches,
+          b->searches ? (double)b->cutoffs / b->searches : 0,
+          b->searches + b->cache_hits + b->proven_hits
+              ? (double)b->cache_hits /
+                    (b->searches + b->cache_hits + b->proven_hits)
+              : 0,
+          b->searches + b->cache_hits + b->proven_hits
+              ? (double)b->proven_hits /
+                    (b->searches + b->cache_hits + b->proven_hits)
+              : 0);
+
+  if (turn_budget > 0)
+    fprintf(stream, ",\"turn_budget_ms\":%.3f", 1e3 * turn_budget);
+
+  if (b->paired_turns > 0)
+    fprintf(stream, ",\"paired_gain\":%.3f",
+            b->paired_gain / b->paired_turns);
+
+  if (b->games > 0) {
+    fprintf(stream, ",");
+    print_win_rate(stream, b->won, b->games);
+  }
+
+  fprintf(stream, "}\n");
+  fflush(stream);
+}
+
+/* play a fixed corpus of seeded deals to the end, and search one turn of
+ * mid-game positions of another set of deals, reached by following a winning
+ * line with open cards or else random moves; reports both as lines of json */
+static void bench(int num_workers, int num_games) {
+  rng r = game_rng;
+  agent *a = agent_alloc(num_workers, &r);
+  game_state *game = state_alloc(), *scratch = state_alloc();
+  bench_stats deals = {0}, midgame = {0};
+
+  for (int g = 0; g < num_games; ++g) {
+    random_init(game, &r);
+    ++deals.games;
+    for (int turn = 0, player = 0;; ++turn) {
+      if (!game->hands[player])
+        player = !player;
+      if (!game->hands[player]) {
+        ++deals.won;
+        break;
+      }
+
+      double start = now();
+      int idx = play_turn(a, game, player, NULL);
+      bench_turn(&deals, &a->stats, now() - start);
+
+      if (idx == -1)
+        break;
+      play_move(game, player, idx_to_move(game, idx));
+      player = !player;
+    }
+  }
+
+  bench_report(stdout, "deals", num_workers, &deals);
+
+  for (int g = 0; g < num_games; ++g) {
+    random_init(game, &r);
+    int player = 0, turn = 0;
+    for (; turn < BENCH_MIDGAME_TURNS && game->pile_count < game->max_piles;
+         ++turn) {
+      int idx;
+      copy_game_state(game, scratch);
+      if (search(scratch, player, BENCH_LINE_NODES, -1, &idx) != 1)
+        idx = random_move(game, scratch, player, &r);
+      if (idx == -1)
+        break;
+      play_move(game, player, idx_to_move(game, idx));
+      player = !player;
+    }
+    if (turn < BENCH_MIDGAME_TURNS || game->pile_count >= game->max_piles ||
+        !game->hands[player])
+      continue;
+
+    double start = now();
+    play_turn(a, game, player, NULL);
+    bench_turn(&midgame, &a->stats, now() - start);
+  }
+
+  bench_report(stdout, "midgame", num_workers, &midgame);
+
+  free(deals.turn_seconds);
+  free(midgame.turn_seconds);
+  agent_free(a);
+  free(game);
+  free(scratch);
+}
+
+/* tournament: every game has its own seed, derived from the master seed and
+ * its index, and is played by a single worker with an empty transposition
+ * table, so that it can be replayed on its own with -g */
+static uint64_t master_seed = 111;
+
+static const struct {
+  char *name;
+  int max_piles;
+} difficulties[] = {{"hard", 5}, {"medium", 6}, {"easy", 7}};
+
+#define NUM_DIFFICULTIES 3
+
+static rng game_seed(uint64_t seed, int index) {
+  rng r;
+  uint64_t x = splitmix64(&seed) ^ index;
+  for (int i = 0; i < 4; ++i)
+    r.s[i] = splitmix64(&x);
+  return r;
+}
+
+/* play game index with the given number of piles from its seed */
+static int play_seeded_game(agent *a, int index, int max_piles,
+                            FILE *out) {
+  game_state *game = state_alloc();
+  rng r = game_seed(master_seed, index);
+  random_init(game, &r);
+  game->max_piles = max_piles;
+  agent_seed(a, &r);
+  int won = play_game(a, game, index, out);
+  free(game);
+  return won;
+}
+
+typedef struct tournament {
+  int num_games;
+  int difficulty; /* index into difficulties, or -1 for all */
+  int next_job;   /* next game and difficulty to claim */
+  uint8_t *won;   /* by game and difficulty */
+} tournament;
+
+typedef struct tournament_thread {
+  pthread_t thread;
+  tournament *t;
+  agent *agent;
+} tournament_thread;
+
+static void *play_tournament(void *arg) {
+  tournament_thread *th = arg;
+  tournament *t = th->t;
+  int per_game = t->difficulty == -1 ? NUM_DIFFICULTIES : 1;
+
+  for (;;) {
+    int job = __atomic_fetch_add(&t->next_job, 1, __ATOMIC_RELAXED);
+    if (job >= t->num_games * per_game)
+      break;
+    int d = t->difficulty == -1 ? job % per_game : t->difficulty;
+    t->won[job] = play_seeded_game(th->agent, job / per_game,
+                                   difficulties[d].max_piles, NULL);
+  }
+
+  return NULL;
+}
+
+/* play num_games seeded games per difficulty on all threads and print the
+ * win rates as json */
+static void run_tournament(int num_threads, int num_games, int difficulty) {
+  int per_game = difficulty == -1 ? NUM_DIFFICULTIES : 1;
+  tournament t = {.num_games = num_games,
+                  .difficulty = difficulty,
+                  .next_job = 0,
+                  .won = calloc(num_games * per_game, 1)};
+  tournament_thread *threads = malloc(num_threads * sizeof(*threads));
+  if (t.won == NULL || threads == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  double start = now();
+
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i].t = &t;
+    threads[i].agent = agent_alloc(1, &game_rng);
+  }
+  for (int i = 1; i < num_threads; ++i) {
+    if (pthread_create(&threads[i].thread, NULL, play_tournament,
+                       &threads[i]) != 0) {
+      fprintf(stderr, "failed to create thread\n");
+      exit(1);
+    }
+  }
+  play_tournament(&threads[0]);
+  for (int i = 1; i < num_threads; ++i)
+    pthread_join(threads[i].thread, NULL);
+
+  printf("{\"tournament\":{\"seed\":%" PRIu64 ",\"threads\":%d,"
+         "\"seconds\":%.3f,",
+         master_seed, num_threads, now() - start);
+  int total = 0;
+  for (int i = 0; i < num_games * per_game; ++i)
+    total += t.won[i];
+  print_win_rate(stdout, total, num_games * per_game);
+  printf("},\"difficulties\":[");
+
+  for (int k = 0; k < per_game; ++k) {
+    int d = difficulty == -1 ? k : difficulty;
+    int won = 0;
+    for (int g = 0; g < num_games; ++g)
+      won += t.won[g * per_game + k];
+    printf("%s{\"difficulty\":\"%s\",\"max_piles\":%d,", k ? "," : "",
+           difficulties[d].name, difficulties[d].max_piles);
+    print_win_rate(stdout, won, num_games);
+    /* replay these with -g index -m max_piles */
+    printf(",\"lost\":[");
+    for (int g = 0, first = 1; g < num_games; ++g) {
+      if (t.won[g * per_game + k])
+        continue;
+      printf("%s%d", first ? "" : ",", g);
+      first = 0;
+    }
+    printf("]}");
+  }
+  printf("]}\n");
+
+  for (int i = 0; i < num_threads; ++i)
+    agent_free(threads[i].agent);
+  free(threads);
+  free(t.won);
+}
+
+/* replay analysis: search the turns of recorded games again, with the
+ * settings given now, and log each one with the move played then */
+typedef struct replay {
+  const game_record *records;
+  int *job_record; /* record and turn of each job */
+  int *job_turn;
+  int num_jobs;
+  int next_job; /* next turn to claim */
+  int agree;    /* turns where the search chose the move played */
+  int invalid;  /* turns of records that are not valid */
+} replay;
+
+typedef struct replay_thread {
+  pthread_t thread;
+  replay *r;
+  agent *agent;
+} replay_thread;
+
+/* set up game before turn of record r; returns the player to move or -1 if
+ * the record is not valid up to that turn */
+static int replay_turn(const game_record *r, int turn, game_state *game) {
+  uint64_t deck = 0;
+  init_state(game);
+  for (int i = 0; i < 36; ++i) {
+    if (r->deck[i] >= 36)
+      return -1;
+    deck |= UINT64_C(1) << r->deck[i];
+    game->pile[i] = game->cards + r->deck[i];
+  }
+  if (deck != UINT64_C(0xfffffffff) || r->max_piles < 1 ||
+      r->max_piles > PILE_LIMIT || r->num_moves > RECORD_MAX_MOVES)
+    return -1;
+  deal(game);
+  game->max_piles = r->max_piles;
 
-  /* hand * (extra or NULL) */
-  int win_count[36 * 37];
-  int loss_count[36 * 37];
-  int unknown_count[36 * 37];
+  /* the players take turns like in play_game() */
+  int player = 0;
+  for (int t = 0;; ++t) {
+    if (!game->hands[player])
+      player = !player;
+    if (t == turn)
+      return game->hands[player] ? player : -1;
+
+    move moves[MAX_MOVES];
+    int legal_moves = generate_moves(game, player, moves, 0);
+    int i = 0;
+    while (i < legal_moves && move_to_idx(game, moves[i]) != r->moves[t])
+      ++i;
+    if (i == legal_moves)
+      return -1;
+    play_move(game, player, idx_to_move(game, r->moves[t]));
+    player = !player;
+  }
+}
 
-  /* number of games */
-  for (int g = 0; g < TOTAL_GAMES; ++g) {
-    printf("\n\nGAME %d\n", g);
+/* the turns to search of a record; one that replay_turn() rejects if it has
+ * more moves than a record can hold */
+static int record_turns(const game_record *r) {
+  return r->num_moves <= RECORD_MAX_MOVES ? r->num_moves : 1;
+}
 
-    random_init(&game);
+static void *replay_turns(void *arg) {
+  replay_thread *th = arg;
+  replay *r = th->r;
+  game_state *game = state_alloc();
 
-    int player = 0;
-    for (int turn = 0;; ++turn) {
-      print_state(stdout, &game, 1);
+  for (;;) {
+    int job = __atomic_fetch_add(&r->next_job, 1, __ATOMIC_RELAXED);
+    if (job >= r->num_jobs)
+      break;
+    const game_record *record = &r->records[r->job_record[job]];
+    int turn = r->job_turn[job];
+    int player = replay_turn(record, turn, game);
+    if (player == -1) {
+      __atomic_add_fetch(&r->invalid, 1, __ATOMIC_RELAXED);
+      continue;
+    }
 
-      /* determine if there are any cards to play */
-      if (!game.hands[player])
-        player = !player;
+    /* the same result for a turn whichever thread searches it */
+    rng seed = game_seed(master_seed ^ record->index, turn);
+    agent_seed(th->agent, &seed);
+    double start = now();
+    int best_move_idx = play_turn(th->agent, game, player, NULL);
+    log_turn(record->index, turn, game, player, &th->agent->stats,
+             best_move_idx, record->moves[turn], now() - start);
+    if (best_move_idx == record->moves[turn])
+      __atomic_add_fetch(&r->agree, 1, __ATOMIC_RELAXED);
+  }
 
-      if (!game.hands[player]) {
-        ++games_won;
-        break;
-      }
+  free(game);
+  return NULL;
+}
 
-      int other = !player;
+/* search the turns of the records in path again on all threads, or only
+ * those of record number only if it is not -1, and of them only turn
+ * only_turn if it is not -1, and log them to turn_log */
+static int run_replay(int num_threads, const char *path, int only,
+                      int only_turn) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(path);
+    return 1;
+  }
+  const record_header *h =
+      st.st_size >= (off_t)sizeof(record_header)
+          ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+          : MAP_FAILED;
+  close(fd);
+  if (h == MAP_FAILED || memcmp(h->magic, RECORD_MAGIC, 4) != 0 ||
+      h->version != RECORD_VERSION ||
+      h->record_size != sizeof(game_record)) {
+    fprintf(stderr, "%s: not a file of game records\n", path);
+    return 1;
+  }
+  int num_records =
+      (st.st_size - sizeof(record_header)) / sizeof(game_record);
+  if (only >= num_records) {
+    fprintf(stderr, "%s: no record %d\n", path, only);
+    return 1;
+  }
+  const game_record *records = (const game_record *)(h + 1);
+  if (only_turn >= 0 &&
+      (only == -1 || only_turn >= record_turns(&records[only]))) {
+    fprintf(stderr, "%s: no turn %d of record %d\n", path, only_turn, only);
+    return 1;
+  }
 
-      copy_game_state(&game, &simulation);
+  replay r = {.records = records,
+              .num_jobs = 0,
+              .next_job = 0,
+              .agree = 0,
+              .invalid = 0};
+  int first = only == -1 ? 0 : only;
+  int last = only == -1 ? num_records : only + 1;
+  int total = 0;
+  for (int i = first; i < last; ++i)
+    total += record_turns(&r.records[i]);
+  r.job_record = malloc((total + 1) * sizeof(int));
+  r.job_turn = malloc((total + 1) * sizeof(int));
+  replay_thread *threads = malloc(num_threads * sizeof(*threads));
+  if (r.job_record == NULL || r.job_turn == NULL || threads == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (int i = first; i < last; ++i) {
+    for (int t = 0; t < record_turns(&r.records[i]); ++t) {
+      if (only_turn >= 0 && t != only_turn)
+        continue;
+      r.job_record[r.num_jobs] = i;
+      r.job_turn[r.num_jobs++] = t;
+    }
+  }
 
-      printf("\n\nTURN %d (player %d)\n", turn, player + 1);
+  double start = now();
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i].r = &r;
+    threads[i].agent = agent_alloc(1, &game_rng);
+  }
+  for (int i = 1; i < num_threads; ++i) {
+    if (pthread_create(&threads[i].thread, NULL, replay_turns, &threads[i]) !=
+        0) {
+      fprintf(stderr, "failed to create thread\n");
+      exit(1);
+    }
+  }
+  replay_turns(&threads[0]);
+  for (int i = 1; i < num_threads; ++i)
+    pthread_join(threads[i].thread, NULL);
+
+  fflush(turn_log);
+  printf("{\"replay\":{\"records\":%d,\"turns\":%d,\"invalid\":%d,"
+         "\"agree\":%d,\"threads\":%d,\"seconds\":%.3f}}\n",
+         last - first, r.num_jobs, r.invalid, r.agree, num_threads,
+         now() - start);
+
+  for (int i = 0; i < num_threads; ++i)
+    agent_free(threads[i].agent);
+  free(threads);
+  free(r.job_record);
+  free(r.job_turn);
+  munmap((void *)h, st.st_size);
+  return r.invalid != 0;
+}
 
-      for (int i = 0; i < 36 * 37; ++i) {
-        win_count[i] = 0;
-        loss_count[i] = 0;
-        unknown_count[i] = 0;
-      }
+/* opening book generator: search the first turn of every hand that can be
+ * dealt, up to one of each color shift, that the book at path does not have
+ * yet, or only the first max_new of them if not -1. the book is rewritten
+ * with the old and new entries once all are searched */
+typedef struct book_builder {
+  uint64_t *keys; /* to search */
+  uint64_t *entries;
+  int num_keys;
+  int next_key; /* next key to claim */
+} book_builder;
+
+typedef struct book_thread {
+  pthread_t thread;
+  book_builder *b;
+  agent *agent;
+} book_thread;
+
+static void *build_book(void *arg) {
+  book_thread *th = arg;
+  book_builder *b = th->b;
+  game_state *game = state_alloc();
+
+  for (;;) {
+    int job = __atomic_fetch_add(&b->next_key, 1, __ATOMIC_RELAXED);
+    if (job >= b->num_keys)
+      break;
+    uint64_t key = b->keys[job];
+    uint64_t hand = key & UINT64_C(0xfffffffff);
+
+    /* the hand is dealt from the end of the deck, the other cards at random */
+    rng r = game_seed(master_seed ^ hand, key >> 36);
+    init_state(game);
+    int n = 0, m = 36 - NUM_START;
+    for (int c = 0; c < 36; ++c)
+      game->pile[hand >> c & 1 ? m++ : n++] = game->cards + c;
+    for (int i = 0; i < n; ++i) {
+      int j = i + random_next(&r) % (n - i);
+      card *tmp = game->pile[j];
+      game->pile[j] = game->pile[i];
+      game->pile[i] = tmp;
+    }
+    deal(game);
+    game->max_piles = key >> 36;
 
-      int wins = 0, losses = 0;
+    agent_seed(th->agent, &r);
+    int idx = play_turn(th->agent, game, 0, NULL);
+    b->entries[job] = idx >= 0 ? key << BOOK_MOVE_BITS | idx : 0;
+  }
 
-      /* if there are no cards to draw we have perfect information: no need for
-       * monte carlo */
-      if (simulation.draw_pile_size == 0) {
-        simulation.nodes = 0;
+  free(game);
+  return NULL;
+}
 
-        int result = play(&simulation, player, 0, -1, -1);
+static int run_book(int num_threads, const char *path, int max_new) {
+  /* the book so far, if there is one */
+  const uint64_t *old = NULL;
+  uint64_t num_old = 0;
+  if (access(path, F_OK) == 0 && (old = map_book(path, &num_old)) == NULL)
+    return 1;
 
-        if (result != 1) {
-          ++losses;
-        } else {
-          saved_move m = simulation.stack[0];
-          int card_idx = (m.hand - simulation.cards) * 37 +
-                         (m.extra ? m.extra - simulation.cards : 36);
-          ++win_count[card_idx];
+  /* hands of NUM_START cards as masks, in increasing order */
+  book_builder b = {.num_keys = 0, .next_key = 0};
+  int max_keys = 0;
+  for (uint64_t hand = (1 << NUM_START) - 1; hand < UINT64_C(1) << 36;) {
+    int shift;
+    uint64_t key = book_key(hand, difficulty, &shift);
+    if (shift == 0 && book_find(old, num_old, key) == -1 &&
+        (max_new == -1 || b.num_keys < max_new)) {
+      if (b.num_keys == max_keys) {
+        max_keys = 2 * max_keys + 1024;
+        b.keys = realloc(b.keys, max_keys * sizeof(uint64_t));
+        if (b.keys == NULL) {
+          fprintf(stderr, "out of memory\n");
+          exit(1);
         }
-      } else {
-        /* do a monte carlo simulation */
-        for (int run = 0; run < TOTAL_SIMULATIONS; ++run) {
-          simulation.nodes = 0;
-
-          /* put the other player's cards back in the pile */
-          int num_cards_other_player = 0;
-          card **other_hand = &simulation.hands[other];
-          while (*other_hand) {
-            /* retain visible cards */
-            if ((*other_hand)->visible) {
-              other_hand = &(*other_hand)->down;
-              continue;
-            }
-            /* put non-visible cards back in the pile */
-            simulation.pile[simulation.draw_pile_size] = *other_hand;
-            *other_hand = (*other_hand)->down;
-            simulation.pile[simulation.draw_pile_size]->down = NULL;
-            ++simulation.draw_pile_size;
-            ++num_cards_other_player;
-          }
+      }
+      b.keys[b.num_keys++] = key;
+    }
+    /* the next larger mask with as many bits */
+    uint64_t low = hand & -hand, next = hand + low;
+    hand = next | ((hand ^ next) / low) >> 2;
+  }
 
-          /* shuffle the deck */
-          for (int i = 0; i < simulation.draw_pile_size; ++i) {
-            int j = i + random_next() % (simulation.draw_pile_size - i);
-            card *tmp = simulation.pile[j];
-            simulation.pile[j] = simulation.pile[i];
-            simulation.pile[i] = tmp;
-          }
+  b.entries = malloc((num_old + b.num_keys + 1) * sizeof(uint64_t));
+  book_thread *threads = malloc(num_threads * sizeof(*threads));
+  if (b.entries == NULL || threads == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
 
-          /* deal the other player new cards */
-          for (int i = 0; i < num_cards_other_player; ++i) {
-            card *c = simulation.pile[--simulation.draw_pile_size];
-            c->down = simulation.hands[other];
-            simulation.hands[other] = c;
-          }
+  double start = now();
+  total_simulations = BOOK_SIMULATIONS;
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i].b = &b;
+    threads[i].agent = agent_alloc(1, &game_rng);
+  }
+  for (int i = 1; i < num_threads; ++i) {
+    if (pthread_create(&threads[i].thread, NULL, build_book, &threads[i]) !=
+        0) {
+      fprintf(stderr, "failed to create thread\n");
+      exit(1);
+    }
+  }
+  build_book(&threads[0]);
+  for (int i = 1; i < num_threads; ++i)
+    pthread_join(threads[i].thread, NULL);
+
+  /* merge with the old entries, and drop hands without a move */
+  int num_new = 0;
+  for (int i = 0; i < b.num_keys; ++i)
+    if (b.entries[i])
+      b.entries[num_new++] = b.entries[i];
+  if (num_old > 0)
+    memcpy(b.entries + num_new, old, num_old * sizeof(uint64_t));
+  uint64_t num_entries = num_old + num_new;
+  qsort(b.entries, num_entries, sizeof(uint64_t), compare_entries);
+
+  /* write a new file and move it over the old one */
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  book_header h = {.magic = BOOK_MAGIC,
+                   .version = BOOK_VERSION,
+                   .num_entries = num_entries};
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL || fwrite(&h, sizeof(h), 1, f) != 1 ||
+      fwrite(b.entries, sizeof(uint64_t), num_entries, f) != num_entries ||
+      fclose(f) != 0 || rename(tmp, path) != 0) {
+    perror(path);
+    return 1;
+  }
 
-          int result =
-              play(&simulation, player, 0, MAX_NODES_PER_SIMULATION, run);
-
-          saved_move m = simulation.stack[0];
-          int card_idx = (m.hand - simulation.cards) * 37 +
-                         (m.extra ? m.extra - simulation.cards : 36);
-          if (result == 0) {
-            ++losses;
-            ++loss_count[card_idx];
-          } else if (result == 1) {
-            ++wins;
-            /* increment count and early exit if we certainly play this */
-            if (++win_count[card_idx] > TOTAL_SIMULATIONS / 2)
-              break;
-          } else {
-            ++unknown_count[card_idx];
-          }
-        }
+  printf("{\"book\":{\"max_piles\":%d,\"simulations\":%d,\"searched\":%d,"
+         "\"entries\":%" PRIu64 ",\"threads\":%d,\"seconds\":%.3f}}\n",
+         difficulty, total_simulations, b.num_keys, num_entries, num_threads,
+         now() - start);
+
+  for (int i = 0; i < num_threads; ++i)
+    agent_free(threads[i].agent);
+  free(threads);
+  free(b.keys);
+  free(b.entries);
+  return 0;
+}
+
+/* endgame tablebase file: a header and the entries of tablebase_lost(). the
+ * keys are those of init_zobrist(), so a table is only valid for as long as
+ * they do not change */
+#define TABLEBASE_MAGIC "BRNT"
+#define TABLEBASE_VERSION 2
+#define TABLEBASE_CARDS 5 /* default of -k */
+
+typedef struct tablebase_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t max_piles;
+  uint32_t max_cards;
+  uint64_t num_entries;
+} tablebase_header;
+
+/* map the tablebase at path for the searches to probe; returns 0 on success */
+static int map_tablebase(const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(path);
+    return 1;
+  }
+  const tablebase_header *h =
+      st.st_size >= (off_t)sizeof(tablebase_header)
+          ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+          : MAP_FAILED;
+  close(fd);
+  if (h == MAP_FAILED || memcmp(h->magic, TABLEBASE_MAGIC, 4) != 0 ||
+      h->version != TABLEBASE_VERSION || h->max_piles > PILE_LIMIT ||
+      (uint64_t)st.st_size !=
+          sizeof(tablebase_header) + h->num_entries * sizeof(uint64_t)) {
+    fprintf(stderr, "%s: not a tablebase\n", path);
+    return 1;
+  }
+  tablebase = (const uint64_t *)(h + 1);
+  tablebase_entries = h->num_entries;
+  tablebase_cards = h->max_cards;
+  tablebase_piles = h->max_piles;
+  return 0;
+}
+
+/* tablebase generator: every position with up to max_cards cards left at the
+ * pile limit of -m, a layer of as many cards left at a time from one card up.
+ * no move brings a discarded card back, so the searches of a layer end at the
+ * positions of the layers below, which the table already has, and only
+ * search the moves that discard nothing. a layer places its cards, up to
+ * color shifts, in every way in the hands, the draw pile in any order, and
+ * piles of a card with cover cards on it, of which only the top one matters */
+#define COVER_CARDS UINT64_C(0x00003f000)
+
+typedef struct tablebase_builder {
+  uint64_t *sets; /* the cards left of the positions, one set per job */
+  int num_sets;
+  int next_set; /* next set to claim */
+} tablebase_builder;
+
+typedef struct tablebase_thread {
+  pthread_t thread;
+  tablebase_builder *b;
+  game_state *game;
+  packed_state p; /* the position being placed */
+  uint64_t left;
+  uint64_t positions; /* searched */
+  uint64_t *lost;     /* keys of the lost positions */
+  uint64_t num_lost;
+  uint64_t max_lost;
+} tablebase_thread;
+
+/* search the placed position with either player to move */
+static void tablebase_search(tablebase_thread *th) {
+  game_state *s = th->game;
+  uint64_t *tt = s->tt;
+  set_position(&th->p, th->left, s);
+  s->tt = tt;
+
+  for (int player = 0; player < 2; ++player) {
+    /* the checks of enter_node() before the probe */
+    if (s->hands[player] == NULL || !winnable(s) || !can_move(s, player))
+      continue;
+    ++th->positions;
+    if (play(s, player, UINT64_MAX, -1) != 0)
+      continue;
+    if (th->num_lost == th->max_lost) {
+      th->max_lost = 2 * th->max_lost + 1024;
+      th->lost = realloc(th->lost, th->max_lost * sizeof(uint64_t));
+      if (th->lost == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
       }
+    }
+    th->lost[th->num_lost++] =
+        canonical_key(&s->key) ^ (player ? zobrist_player : 0);
+  }
+}
+
+/* every order of the draw pile from card i up */
+static void tablebase_draw(tablebase_thread *th, int i) {
+  packed_state *p = &th->p;
+  if (i + 1 >= p->draw_pile_size) {
+    tablebase_search(th);
+    return;
+  }
+  for (int j = i; j < p->draw_pile_size; ++j) {
+    uint8_t tmp = p->draw_pile[i];
+    p->draw_pile[i] = p->draw_pile[j];
+    p->draw_pile[j] = tmp;
+    tablebase_draw(th, i + 1);
+    p->draw_pile[j] = p->draw_pile[i];
+    p->draw_pile[i] = tmp;
+  }
+}
+
+/* every top card of the piles from pile i up */
+static void tablebase_tops(tablebase_thread *th, int i) {
+  packed_state *p = &th->p;
+  if (i == p->pile_count) {
+    tablebase_draw(th, 0);
+    return;
+  }
+  uint8_t *pile = p->piles[i];
+  int top = p->pile_size[i] - 1;
+  if (top < 2) {
+    tablebase_tops(th, i + 1);
+    return;
+  }
+  for (int j = 1; j <= top; ++j) {
+    uint8_t tmp = pile[j];
+    pile[j] = pile[top];
+    pile[top] = tmp;
+    tablebase_tops(th, i + 1);
+    pile[top] = pile[j];
+    pile[j] = tmp;
+  }
+}
 
-      printf("losses = %d. wins = %d\n", losses, wins);
+/* every pile for each of the cover cards */
+static void tablebase_covers(tablebase_thread *th, uint64_t covers) {
+  packed_state *p = &th->p;
+  if (covers == 0) {
+    tablebase_tops(th, 0);
+    return;
+  }
+  for (int i = 0; i < p->pile_count; ++i) {
+    p->piles[i][p->pile_size[i]++] = __builtin_ctzll(covers);
+    tablebase_covers(th, covers & (covers - 1));
+    --p->pile_size[i];
+  }
+}
+
+/* every position with the cards of left */
+static void tablebase_place(tablebase_thread *th, uint64_t left) {
+  packed_state *p = &th->p;
+  int cards[36], n = 0;
+  for (uint64_t m = left; m; m &= m - 1)
+    cards[n++] = __builtin_ctzll(m);
+  th->left = left;
+
+  /* 2 bits per card: in a hand, in the draw pile or on the table */
+  for (uint64_t places = 0; places < UINT64_C(1) << 2 * n; ++places) {
+    memset(p, 0, sizeof(packed_state));
+    p->max_piles = difficulty;
+    uint64_t table = 0;
+    for (int i = 0; i < n; ++i) {
+      int place = places >> 2 * i & 3;
+      if (place < 2)
+        p->hands[place][p->hand_size[place]++] = cards[i];
+      else if (place == 2)
+        p->draw_pile[p->draw_pile_size++] = cards[i];
+      else
+        table |= UINT64_C(1) << cards[i];
+    }
+    /* won */
+    if (p->hand_size[0] + p->hand_size[1] == 0)
+      continue;
 
-      int best_move = 0;
-      int best_move_idx = -1;
-      for (int i = 0; i < 36 * 37; ++i) {
-        /* assume that no solution found is 50% chance of winning */
-        int win_factor = 2 * win_count[i] + unknown_count[i];
-        if (win_factor > best_move) {
-          best_move = win_factor;
-          best_move_idx = i;
+    /* the cover cards that are not a pile of their own */
+    uint64_t covers = table & COVER_CARDS;
+    for (uint64_t on = covers;; on = (on - 1) & covers) {
+      uint64_t bottoms = table & ~on;
+      if ((bottoms || !on) && __builtin_popcountll(bottoms) < difficulty) {
+        p->pile_count = 0;
+        for (uint64_t m = bottoms; m; m &= m - 1) {
+          p->piles[p->pile_count][0] = __builtin_ctzll(m);
+          p->pile_size[p->pile_count++] = 1;
         }
+        tablebase_covers(th, on);
       }
-      for (int i = 0; i < 36 * 37; ++i) {
-        if (win_count[i] == 0 && unknown_count[i] == 0)
-          continue;
-        saved_move mi = idx_to_move(&game, i);
-        print_card(stdout, mi.hand, 0);
-        if (mi.extra) {
-          printf(" ");
-          print_card(stdout, mi.extra, 0);
-        }
-        printf("\n");
-        int win_factor = 2 * win_count[i] + unknown_count[i];
-        for (int j = 0; j < (70.0 * win_factor) / best_move; ++j)
-          printf("*");
-        printf(" (%d)", win_factor);
-        if (i == best_move_idx)
-          printf(" !!");
-        printf("\n");
-      }
-
-      if (best_move_idx == -1) {
-        printf("no win found\n");
+      if (on == 0)
         break;
-      }
+    }
+  }
+}
 
-      saved_move best = idx_to_move(&game, best_move_idx);
+static void *build_tablebase(void *arg) {
+  tablebase_thread *th = arg;
+  tablebase_builder *b = th->b;
+  for (;;) {
+    int job = __atomic_fetch_add(&b->next_set, 1, __ATOMIC_RELAXED);
+    if (job >= b->num_sets)
+      break;
+    tablebase_place(th, b->sets[job]);
+  }
+  return NULL;
+}
 
-      /* remove from hand */
-      move m = {NULL, NULL};
-      card *c = best.hand;
-      for (m.hand = &game.hands[player]; *m.hand != best.hand;
-           m.hand = &(*m.hand)->down)
-        ;
-      *m.hand = (*m.hand)->down;
-      best.hand->down = NULL;
-
-      if (best.extra) {
-        /* locate other card in hand */
-        if (best.hand->action == GIVE || best.hand->action == PLUS_ONE) {
-          for (m.extra = &game.hands[player]; *m.extra != best.extra;
-               m.extra = &(*m.extra)->down)
-            ;
-        }
-        /* locate pile */
-        if (best.hand->action == COVER || best.hand->action == TAKE) {
-          for (m.extra = &game.table; *m.extra != best.extra;
-               m.extra = &(*m.extra)->right)
-            ;
-        }
-      }
+static int run_tablebase(int num_threads, const char *path, int max_cards) {
+  tablebase_thread *threads = calloc(num_threads, sizeof(*threads));
+  if (threads == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i].game = malloc(sizeof(game_state));
+    if (threads[i].game == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    init_state(threads[i].game);
+    threads[i].game->tt = tt_alloc();
+  }
 
-      /* todo: DRY playing a move */
-      if (c->action == REMOVE_COLOR || c->action == REMOVE_TYPE) {
-        for (card **p = &game.table; *p;) {
-          card *q = *p;
-          while (q->down)
-            q = q->down;
-          if ((c->action == REMOVE_COLOR && q->color == c->remove_color) ||
-              (c->action == REMOVE_TYPE && q->type == c->remove_type)) {
-            /* keep track of what is removed */
-            --game.pile_count;
-            for (card *r = *p; r; r = r->down)
-              remove_card(&game, r);
-            *p = (*p)->right;
-          } else {
-            p = &(*p)->right;
+  uint64_t *entries = NULL;
+  uint64_t num_entries = 0;
+  double start = now();
+  tablebase_piles = difficulty;
+  for (int k = 1; k <= max_cards; ++k) {
+    /* sets of k cards as masks, up to color shifts */
+    tablebase_builder b = {.sets = NULL, .num_sets = 0, .next_set = 0};
+    int max_sets = 0;
+    for (uint64_t left = (UINT64_C(1) << k) - 1; left < UINT64_C(1) << 36;) {
+      int shift;
+      book_key(left, 0, &shift);
+      if (shift == 0) {
+        if (b.num_sets == max_sets) {
+          max_sets = 2 * max_sets + 1024;
+          b.sets = realloc(b.sets, max_sets * sizeof(uint64_t));
+          if (b.sets == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
           }
         }
+        b.sets[b.num_sets++] = left;
       }
+      /* the next larger mask with as many bits */
+      uint64_t low = left & -left, next = left + low;
+      left = next | ((left ^ next) / low) >> 2;
+    }
 
-      if (m.extra) {
-        switch (c->action) {
-        case COVER: {
-          card **covered_card = m.extra;
-          while (*covered_card)
-            covered_card = &(*covered_card)->down;
-          *covered_card = c;
-          break;
-        }
+    for (int i = 0; i < num_threads; ++i) {
+      threads[i].b = &b;
+      threads[i].positions = 0;
+      threads[i].num_lost = 0;
+    }
+    for (int i = 1; i < num_threads; ++i) {
+      if (pthread_create(&threads[i].thread, NULL, build_tablebase,
+                         &threads[i]) != 0) {
+        fprintf(stderr, "failed to create thread\n");
+        exit(1);
+      }
+    }
+    build_tablebase(&threads[0]);
+    for (int i = 1; i < num_threads; ++i)
+      pthread_join(threads[i].thread, NULL);
+    free(b.sets);
+
+    /* the layer joins the table that the next one probes. a set that is its
+     * own color shift has positions with the same key */
+    uint64_t positions = 0, num_layer = 0;
+    for (int i = 0; i < num_threads; ++i) {
+      positions += threads[i].positions;
+      num_layer += threads[i].num_lost;
+    }
+    entries =
+        realloc(entries, (num_entries + num_layer + 1) * sizeof(uint64_t));
+    if (entries == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    for (int i = 0; i < num_threads; ++i) {
+      memcpy(entries + num_entries, threads[i].lost,
+             threads[i].num_lost * sizeof(uint64_t));
+      num_entries += threads[i].num_lost;
+    }
+    qsort(entries, num_entries, sizeof(uint64_t), compare_entries);
+    uint64_t unique = 0;
+    for (uint64_t i = 0; i < num_entries; ++i)
+      if (unique == 0 || entries[i] != entries[unique - 1])
+        entries[unique++] = entries[i];
+    num_layer -= num_entries - unique;
+    num_entries = unique;
+    tablebase = entries;
+    tablebase_entries = num_entries;
+    tablebase_cards = k;
+
+    printf("{\"tablebase\":{\"max_piles\":%d,\"cards\":%d,"
+           "\"positions\":%" PRIu64 ",\"lost\":%" PRIu64 ",\"entries\":%" PRIu64
+           ",\"threads\":%d,\"seconds\":%.3f}}\n",
+           difficulty, k, positions, num_layer, num_entries, num_threads,
+           now() - start);
+    fflush(stdout);
+  }
 
-        case TAKE: {
-          /* iterate to tail of the hand */
-          card **h = &game.hands[player];
-          while (*h)
-            h = &(*h)->down;
-
-          /* move pile to hand, and replace pile on table with card c */
-          card *tmp = *m.extra;
-          *m.extra = c;
-          c->right = tmp->right;
-          *h = tmp;
-
-          /* mark the cards as open */
-          while (*h) {
-            (*h)->visible = 1;
-            h = &(*h)->down;
-          }
+  /* write a new file and move it over the old one */
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  tablebase_header h = {.magic = TABLEBASE_MAGIC,
+                        .version = TABLEBASE_VERSION,
+                        .max_piles = difficulty,
+                        .max_cards = max_cards,
+                        .num_entries = num_entries};
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL || fwrite(&h, sizeof(h), 1, f) != 1 ||
+      fwrite(entries, sizeof(uint64_t), num_entries, f) != num_entries ||
+      fclose(f) != 0 || rename(tmp, path) != 0) {
+    perror(path);
+    return 1;
+  }
 
-          break;
-        }
+  for (int i = 0; i < num_threads; ++i) {
+    free(threads[i].game->tt);
+    free(threads[i].game);
+    free(threads[i].lost);
+  }
+  free(threads);
+  free(entries);
+  tablebase = NULL;
+  tablebase_cards = 0;
+  return 0;
+}
 
-        case PLUS_ONE: {
-          card *second = *m.extra;
-          /* put it on the table */
-          second->right = game.table;
-          game.table = second;
-          /* remove it from the hand */
-          *m.extra = second->down;
-          second->down = NULL;
-          ++game.pile_count;
-          break;
-        }
+/* open deal analysis: solve the deals of the tournament with all cards open,
+ * including the order of the draw pile, at every difficulty. no agent wins a
+ * deal that is lost with open cards, so the fraction of winnable deals bounds
+ * the win rate. searches of more than SOLVE_MAX_NODES nodes count as unknown.
+ * solved deals are appended to a checkpoint file, if any, from which an
+ * interrupted run continues */
+#define SOLVE_MAX_NODES 100000000
+
+typedef struct solver {
+  int num_deals;
+  int next_deal; /* next deal to claim */
+  int solved;
+  char (*results)[NUM_DIFFICULTIES]; /* 'w', 'l', '?' or 0 if not solved */
+  FILE *checkpoint;
+  pthread_mutex_t lock;
+  uint64_t nodes;
+} solver;
 
-        case GIVE: {
-          card *give = *m.extra;
-          /* put it in the other player's hand */
-          card *tmp = game.hands[other];
-          game.hands[other] = give;
-          *m.extra = give->down;
-          give->down = tmp;
-          /* mark as open */
-          give->visible = 1;
-          break;
-        }
-        default:
-          break;
-        }
-      }
+typedef struct solver_thread {
+  pthread_t thread;
+  solver *solver;
+  game_state game;
+  game_state scratch;
+} solver_thread;
+
+/* a deal that is won with some pile limit is won with a larger one too, and
+ * one that is lost is lost with a smaller one, so the difficulties are solved
+ * from hard to easy until the first win */
+static uint64_t solve_deal(solver_thread *st, int index, char *result) {
+  rng r = game_seed(master_seed, index);
+  uint64_t nodes = 0;
+
+  random_init(&st->game, &r);
+
+  for (int d = 0; d < NUM_DIFFICULTIES; ++d)
+    result[d] = '?';
+
+  for (int d = 0; d < NUM_DIFFICULTIES; ++d) {
+    int move_idx;
+    st->game.max_piles = difficulties[d].max_piles;
+    copy_game_state(&st->game, &st->scratch);
+    int won = search(&st->scratch, 0, SOLVE_MAX_NODES, -1, &move_idx);
+    nodes += st->scratch.nodes;
+    if (won == 1) {
+      for (int k = d; k < NUM_DIFFICULTIES; ++k)
+        result[k] = 'w';
+      break;
+    }
+    if (won == 0)
+      for (int k = 0; k <= d; ++k)
+        result[k] = 'l';
+  }
+
+  return nodes;
+}
 
-      /* put card on the table */
-      if (!(m.extra && (c->action == COVER || c->action == TAKE))) {
-        c->right = game.table;
-        game.table = c;
-        ++game.pile_count;
+static void *solve_deals(void *arg) {
+  solver_thread *st = arg;
+  solver *s = st->solver;
+  char result[NUM_DIFFICULTIES];
+
+  for (;;) {
+    int index = __atomic_fetch_add(&s->next_deal, 1, __ATOMIC_RELAXED);
+    if (index >= s->num_deals)
+      break;
+    if (s->results[index][0])
+      continue;
+
+    uint64_t nodes = solve_deal(st, index, result);
+
+    pthread_mutex_lock(&s->lock);
+    memcpy(s->results[index], result, NUM_DIFFICULTIES);
+    s->nodes += nodes;
+    if (s->checkpoint) {
+      fprintf(s->checkpoint, "%d %.*s\n", index, NUM_DIFFICULTIES, result);
+      fflush(s->checkpoint);
+    }
+    if (++s->solved % 1000 == 0)
+      fprintf(stderr, "solved %d deals\n", s->solved);
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  return NULL;
+}
+
+/* read the results of a previous run, and open the file for appending */
+static FILE *open_checkpoint(char *path, solver *s) {
+  FILE *f = fopen(path, "r");
+  if (f) {
+    uint64_t seed;
+    if (fscanf(f, "seed %" SCNu64, &seed) != 1 || seed != master_seed) {
+      fprintf(stderr, "%s is not a checkpoint with seed %" PRIu64 "\n", path,
+              master_seed);
+      exit(1);
+    }
+    int index, last = '\n';
+    char result[NUM_DIFFICULTIES + 1];
+    while (fscanf(f, "%d %3s", &index, result) == 2) {
+      /* skips a line that was cut off */
+      if (index < 0 || index >= s->num_deals ||
+          strlen(result) != NUM_DIFFICULTIES ||
+          strspn(result, "wl?") != NUM_DIFFICULTIES)
+        continue;
+      if (!s->results[index][0])
+        ++s->solved;
+      memcpy(s->results[index], result, NUM_DIFFICULTIES);
+    }
+    fseek(f, -1, SEEK_END);
+    last = fgetc(f);
+    fclose(f);
+
+    f = fopen(path, "a");
+    if (f && last != '\n')
+      fputc('\n', f);
+  } else {
+    f = fopen(path, "w");
+    if (f)
+      fprintf(f, "seed %" PRIu64 "\n", master_seed);
+  }
+
+  if (f == NULL) {
+    fprintf(stderr, "cannot open %s\n", path);
+    exit(1);
+  }
+  return f;
+}
+
+/* solve num_deals open deals on all threads and print the fraction of
+ * winnable deals per difficulty as json */
+static void run_solver(int num_threads, int num_deals, char *checkpoint) {
+  solver s = {.num_deals = num_deals,
+              .next_deal = 0,
+              .solved = 0,
+              .results = calloc(num_deals, NUM_DIFFICULTIES),
+              .checkpoint = NULL,
+              .nodes = 0};
+  solver_thread *threads = malloc(num_threads * sizeof(*threads));
+  if (s.results == NULL || threads == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  pthread_mutex_init(&s.lock, NULL);
+
+  if (checkpoint)
+    s.checkpoint = open_checkpoint(checkpoint, &s);
+
+  double start = now();
+
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i].solver = &s;
+    init_state(&threads[i].scratch);
+    threads[i].scratch.tt = tt_alloc();
+  }
+  for (int i = 1; i < num_threads; ++i) {
+    if (pthread_create(&threads[i].thread, NULL, solve_deals, &threads[i]) !=
+        0) {
+      fprintf(stderr, "failed to create thread\n");
+      exit(1);
+    }
+  }
+  solve_deals(&threads[0]);
+  for (int i = 1; i < num_threads; ++i)
+    pthread_join(threads[i].thread, NULL);
+
+  printf("{\"solve\":{\"seed\":%" PRIu64 ",\"deals\":%d,"
+         "\"max_nodes\":%d,\"threads\":%d,\"seconds\":%.3f,"
+         "\"nodes\":%" PRIu64 "},\"difficulties\":[",
+         master_seed, num_deals, SOLVE_MAX_NODES, num_threads, now() - start,
+         s.nodes);
+  for (int d = 0; d < NUM_DIFFICULTIES; ++d) {
+    int winnable = 0, lost = 0, unknown = 0;
+    for (int i = 0; i < num_deals; ++i) {
+      winnable += s.results[i][d] == 'w';
+      lost += s.results[i][d] == 'l';
+      unknown += s.results[i][d] == '?';
+    }
+    double lo, hi;
+    wilson_interval(winnable, num_deals, &lo, &hi);
+    /* unknown deals might be winnable */
+    printf("%s{\"difficulty\":\"%s\",\"max_piles\":%d,\"winnable\":%d,"
+           "\"lost\":%d,\"unknown\":%d,\"winnable_fraction\":%.4f,"
+           "\"winnable_ci95\":[%.4f,%.4f],\"upper_bound\":%.4f}",
+           d ? "," : "", difficulties[d].name, difficulties[d].max_piles,
+           winnable, lost, unknown, (double)winnable / num_deals, lo, hi,
+           (double)(winnable + unknown) / num_deals);
+  }
+  printf("]}\n");
+
+  for (int i = 0; i < num_threads; ++i)
+    free(threads[i].scratch.tt);
+  if (s.checkpoint)
+    fclose(s.checkpoint);
+  pthread_mutex_destroy(&s.lock);
+  free(threads);
+  free(s.results);
+}
+
+/* advisor: answer positions of live games, one per line, with the ranked
+ * moves of the player to move. a position is a line of space separated fields
+ *
+ *   hand=C,..      the cards of the player to move, top first
+ *   other=C,..     the open cards of the other player
+ *   hidden=N       the number of cards of the other player that are not open
+ *   table=C.C,..   the piles on the table, each one bottom card first
+ *   unknown=C,..   the cards that are in the draw pile or hidden
+ *   piles=N        the pile limit (default: -m)
+ *   ms=N           time to search (default: -d, or a fixed number of
+ *                  simulations)
+ *
+ * with cards numbered 0 to 35 as in brain.h. the other cards are discarded.
+ * the agent keeps the states, random streams and tables of its workers
+ * between positions, but their threads are started for every position, like
+ * for every turn of a game */
+#define ADVISOR_BACKLOG 4
+
+/* parse a list of cards separated by sep into cards; returns their number or
+ * -1 if a card is not valid or already used */
+static int parse_cards(char *s, int sep, uint8_t *cards, int max_cards,
+                       uint64_t *used) {
+  int n = 0;
+  while (*s) {
+    char *end;
+    long c = strtol(s, &end, 10);
+    if (end == s || c < 0 || c >= 36 || (*used >> c & 1) || n == max_cards)
+      return -1;
+    *used |= UINT64_C(1) << c;
+    cards[n++] = c;
+    if (*end == sep)
+      ++end;
+    else if (*end)
+      return -1;
+    s = end;
+  }
+  return n;
+}
+
+/* set up game from a position line with the player to move as player 0;
+ * returns an error message or NULL */
+static const char *parse_position(char *line, game_state *game,
+                                  double *budget) {
+  packed_state p;
+  uint8_t unknown[36];
+  uint64_t used = 0, other = 0;
+  int num_unknown = 0, hidden = 0;
+
+  memset(&p, 0, sizeof(packed_state));
+  p.max_piles = difficulty;
+  *budget = turn_budget;
+
+  for (char *save, *f = strtok_r(line, " \t\r\n", &save); f;
+       f = strtok_r(NULL, " \t\r\n", &save)) {
+    char *value = strchr(f, '=');
+    if (value == NULL)
+      return "field without value";
+    *value++ = '\0';
+
+    if (strcmp(f, "hand") == 0) {
+      int n = parse_cards(value, ',', p.hands[0], 36, &used);
+      if (n < 0)
+        return "bad hand";
+      p.hand_size[0] = n;
+    } else if (strcmp(f, "other") == 0) {
+      uint64_t before = used;
+      int n = parse_cards(value, ',', p.hands[1], 36, &used);
+      if (n < 0)
+        return "bad other";
+      p.hand_size[1] = n;
+      other = used ^ before;
+    } else if (strcmp(f, "unknown") == 0) {
+      num_unknown = parse_cards(value, ',', unknown, 36, &used);
+      if (num_unknown < 0)
+        return "bad unknown";
+    } else if (strcmp(f, "table") == 0) {
+      for (char *save2, *pile = strtok_r(value, ",", &save2); pile;
+           pile = strtok_r(NULL, ",", &save2)) {
+        if (p.pile_count == PILE_LIMIT)
+          return "too many piles";
+        int n = parse_cards(pile, '.', p.piles[p.pile_count], BB_PILE_SIZE,
+                            &used);
+        if (n <= 0)
+          return "bad table";
+        /* only cover cards are played onto a pile */
+        for (int i = 1; i < n; ++i)
+          if (p.piles[p.pile_count][i] / 6 != COVER)
+            return "bad table";
+        p.pile_size[p.pile_count++] = n;
       }
+    } else if (strcmp(f, "hidden") == 0) {
+      char *end;
+      hidden = strtol(value, &end, 10);
+      if (end == value || *end)
+        return "bad hidden";
+    } else if (strcmp(f, "piles") == 0) {
+      char *end;
+      p.max_piles = strtol(value, &end, 10);
+      if (end == value || *end)
+        return "bad piles";
+    } else if (strcmp(f, "ms") == 0) {
+      char *end;
+      double ms = strtod(value, &end);
+      if (end == value || *end || !(ms >= 0))
+        return "bad ms";
+      *budget = 1e-3 * ms;
+    } else {
+      return "unknown field";
+    }
+  }
+
+  if (p.hand_size[0] == 0)
+    return "no cards to play";
+  if (p.max_piles < 1 || p.max_piles > PILE_LIMIT)
+    return "bad piles";
+  if (p.pile_count >= p.max_piles)
+    return "lost";
+  if (hidden < 0 || hidden > num_unknown)
+    return "bad hidden";
+
+  /* the first unknown cards are dealt to the other player for now, the
+   * simulations deal them again */
+  for (int i = 0; i < hidden; ++i)
+    p.hands[1][p.hand_size[1]++] = unknown[i];
+  for (int i = hidden; i < num_unknown; ++i)
+    p.draw_pile[p.draw_pile_size++] = unknown[i];
+  p.visible = other;
+  set_position(&p, used, game);
+  return NULL;
+}
+
+static int compare_scores(const void *a, const void *b) {
+  const int *x = a, *y = b;
+  return y[1] != x[1] ? y[1] - x[1] : x[0] - y[0];
+}
+
+/* answer the positions on in until it is closed */
+static void advise(agent *a, FILE *in, FILE *out) {
+  char *line = NULL;
+  size_t size = 0;
+  game_state *game = state_alloc();
+
+  while (getline(&line, &size, in) != -1) {
+    if (strspn(line, " \t\r\n") == strlen(line))
+      continue;
+
+    double budget;
+    const char *error = parse_position(line, game, &budget);
+    if (error) {
+      fprintf(out, "{\"error\":\"%s\"}\n", error);
+      fflush(out);
+      continue;
+    }
+
+    double start = now();
+    double saved_budget = turn_budget;
+    turn_budget = budget;
+    play_turn(a, game, 0, NULL);
+    turn_budget = saved_budget;
+
+    /* move and score, best first */
+    turn_stats *t = &a->stats;
+    int ranked[36 * 37][2], n = 0;
+    for (int i = 0; i < 36 * 37; ++i) {
+      if (t->win_count[i] == 0 && t->unknown_count[i] == 0)
+        continue;
+      ranked[n][0] = i;
+      ranked[n++][1] = 2 * t->win_count[i] + t->unknown_count[i];
+    }
+    qsort(ranked, n, sizeof(ranked[0]), compare_scores);
+
+    fprintf(out, "{\"moves\":[");
+    for (int i = 0; i < n; ++i)
+      fprintf(out, "%s{\"move\":%d,\"score\":%d,\"wins\":%d,\"unknown\":%d}",
+              i ? "," : "", ranked[i][0], ranked[i][1],
+              t->win_count[ranked[i][0]], t->unknown_count[ranked[i][0]]);
+    fprintf(out, "],\"searches\":%d,\"losses\":%d,\"ms\":%.3f}\n", t->searches,
+            t->losses, 1e3 * (now() - start));
+    fflush(out);
+  }
+  free(line);
+  free(game);
+}
+
+/* advise the clients of a unix socket at path one after the other */
+static int serve(agent *a, const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long\n");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* a client that hangs up must not end the server */
+  signal(SIGPIPE, SIG_IGN);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, ADVISOR_BACKLOG) == -1) {
+    perror(path);
+    return 1;
+  }
+
+  for (;;) {
+    int client = accept(fd, NULL, NULL);
+    if (client == -1) {
+      perror("accept");
+      continue;
+    }
+    FILE *in = fdopen(client, "r");
+    FILE *out = fdopen(dup(client), "w");
+    if (in && out)
+      advise(a, in, out);
+    if (in)
+      fclose(in);
+    if (out)
+      fclose(out);
+  }
+}
 
-      /* take a card from the pile */
-      int draw_card = game.draw_pile_size > 0;
+static void usage(FILE *stream, char *name) {
+  fprintf(stream,
+          "usage: %s [-t threads] [-e pointer|bitboard] [-c games] "
+          "[-b games] [-a delta] [-p] [-d ms] [-m piles]\n"
+          "       [-n games] [-g index[:turn]] [-s seed] [-S deals] [-o file] "
+          "[-A] [-U path]\n"
+          "       [-q] [-l file] [-r file] [-R file] [-O file] [-B file] "
+          "[-T file] [-E file]\n"
+          "       [-k cards]\n"
+          "  -t threads  number of threads for monte carlo simulations "
+          "(default: number of cpus)\n"
+          "  -e engine   search engine (default: pointer)\n"
+          "  -c games    compare the engines on seeded games and exit\n"
+          "  -b games    benchmark on a fixed corpus of games and exit\n"
+          "  -a delta    allocate simulations adaptively to root moves, and "
+          "stop once the best\n"
+          "              move is kept with probability 1 - delta\n"
+          "  -p          search every root move on the same deals (common "
+          "random numbers)\n"
+          "  -d ms       time per turn: simulate until it runs out and play "
+          "the best move so far\n"
+          "  -m piles    lose at 5 (hard, default), 6 (medium) or 7 (easy) "
+          "piles\n"
+          "  -n games    play a tournament of seeded games per difficulty on "
+          "all threads and exit\n"
+          "  -g index    replay one game of the tournament and exit\n"
+          "  -s seed     master seed of the tournament (default: 111)\n"
+          "  -S deals    solve the deals of the tournament with open cards "
+          "and exit\n"
+          "  -o file     checkpoint of -S to continue from\n"
+          "  -A          advise on positions read from stdin, one per line\n"
+          "  -U path     advise the clients of a unix socket at path\n"
+          "  -q          do not print the games\n"
+          "  -l file     log every turn played as a line of json to file\n"
+          "  -r file     record the games played to file\n"
+          "  -R file     search the turns of the recorded games again, or only "
+          "those of record\n"
+          "              -g index or only its turn with -g index:turn, log "
+          "them as with -l\n"
+          "              and exit\n"
+          "  -O file     play the first move from the opening book file\n"
+          "  -B file     add the hands missing in the opening book file for "
+          "-m piles, or only\n"
+          "              the first -n of them, and exit\n"
+          "  -T file     probe the endgame tablebase file in searches\n"
+          "  -E file     write the endgame tablebase of -m piles and -k cards "
+          "to file and exit\n"
+          "  -k cards    cards left of the positions of -E (default: %d)\n",
+          name, TABLEBASE_CARDS);
+}
 
-      if (draw_card) {
-        card *drawn = game.pile[--game.draw_pile_size];
-        drawn->down = game.hands[player];
-        game.hands[player] = drawn;
+int main(int argc, char **argv) {
+  long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int check_games = 0;
+  int bench_games = 0;
+  int tournament_games = 0;
+  int replay_index = -1;
+  int replay_turn_index = -1;
+  int difficulty_idx = -1;
+  int open_deals = 0;
+  char *checkpoint = NULL;
+  int advisor = 0;
+  char *socket_path = NULL;
+  int quiet = 0;
+  char *log_path = NULL;
+  char *record_path = NULL;
+  char *replay_path = NULL;
+  char *book_path = NULL;
+  char *new_book_path = NULL;
+  char *tablebase_path = NULL;
+  char *new_tablebase_path = NULL;
+  int max_cards = TABLEBASE_CARDS;
+
+  const char *options = "t:e:c:b:a:pd:m:n:g:s:S:o:AU:ql:r:R:O:B:T:E:k:h";
+  for (int opt; (opt = getopt(argc, argv, options)) != -1;) {
+    switch (opt) {
+    case 't':
+      num_workers = strtol(optarg, NULL, 10);
+      break;
+    case 'e':
+      if (strcmp(optarg, "pointer") == 0) {
+        engine = POINTER_ENGINE;
+      } else if (strcmp(optarg, "bitboard") == 0) {
+        engine = BITBOARD_ENGINE;
+      } else {
+        usage(stderr, argv[0]);
+        return 1;
+      }
+      break;
+    case 'c':
+      check_games = strtol(optarg, NULL, 10);
+      break;
+    case 'b':
+      bench_games = strtol(optarg, NULL, 10);
+      break;
+    case 'a':
+      adaptive_delta = strtod(optarg, NULL);
+      break;
+    case 'p':
+      paired_mode = 1;
+      break;
+    case 'd':
+      turn_budget = 1e-3 * strtod(optarg, NULL);
+      break;
+    case 'm':
+      difficulty = strtol(optarg, NULL, 10);
+      for (int i = 0; i < NUM_DIFFICULTIES; ++i)
+        if (difficulties[i].max_piles == difficulty)
+          difficulty_idx = i;
+      if (difficulty_idx == -1) {
+        usage(stderr, argv[0]);
+        return 1;
+      }
+      break;
+    case 'n':
+      tournament_games = strtol(optarg, NULL, 10);
+      break;
+    case 'g':
+      replay_index = strtol(optarg, NULL, 10);
+      if (strchr(optarg, ':'))
+        replay_turn_index = strtol(strchr(optarg, ':') + 1, NULL, 10);
+      break;
+    case 's':
+      master_seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'S':
+      open_deals = strtol(optarg, NULL, 10);
+      break;
+    case 'o':
+      checkpoint = optarg;
+      break;
+    case 'A':
+      advisor = 1;
+      break;
+    case 'U':
+      socket_path = optarg;
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    case 'l':
+      log_path = optarg;
+      break;
+    case 'r':
+      record_path = optarg;
+      break;
+    case 'R':
+      replay_path = optarg;
+      break;
+    case 'O':
+      book_path = optarg;
+      break;
+    case 'B':
+      new_book_path = optarg;
+      break;
+    case 'T':
+      tablebase_path = optarg;
+      break;
+    case 'E':
+      new_tablebase_path = optarg;
+      break;
+    case 'k':
+      max_cards = strtol(optarg, NULL, 10);
+      if (max_cards < 1 || max_cards > BB_PILE_SIZE) {
+        usage(stderr, argv[0]);
+        return 1;
       }
+      break;
+    case 'h':
+      usage(stdout, argv[0]);
+      return 0;
+    default:
+      usage(stderr, argv[0]);
+      return 1;
+    }
+  }
 
-      /* next player */
-      player = !player;
+  init_zobrist();
+
+  if (log_path) {
+    turn_log = strcmp(log_path, "-") == 0 ? stdout : fopen(log_path, "w");
+    if (turn_log == NULL) {
+      perror(log_path);
+      return 1;
+    }
+    setvbuf(turn_log, NULL, _IOFBF, TURN_LOG_BUFFER);
+  }
+
+  if (book_path && (book = map_book(book_path, &book_entries)) == NULL)
+    return 1;
+
+  if (tablebase_path && map_tablebase(tablebase_path) != 0)
+    return 1;
+
+  if (record_path) {
+    record_header h = {.magic = RECORD_MAGIC,
+                       .version = RECORD_VERSION,
+                       .record_size = sizeof(game_record)};
+    game_records = fopen(record_path, "wb");
+    if (game_records == NULL ||
+        fwrite(&h, sizeof(h), 1, game_records) != 1) {
+      perror(record_path);
+      return 1;
     }
+  }
+
+  if (check_games > 0)
+    return check_engines(check_games) != 0;
+
+  if (num_workers < 1)
+    num_workers = 1;
+
+  if (bench_games > 0) {
+    bench(num_workers, bench_games);
+    return 0;
+  }
+
+  if (open_deals > 0) {
+    run_solver(num_workers, open_deals, checkpoint);
+    return 0;
+  }
+
+  if (advisor || socket_path) {
+    agent *a = agent_alloc(num_workers, &game_rng);
+    int status = 0;
+    if (socket_path)
+      status = serve(a, socket_path);
+    else
+      advise(a, stdin, stdout);
+    agent_free(a);
+    return status;
+  }
+
+  if (new_tablebase_path)
+    return run_tablebase(num_workers, new_tablebase_path, max_cards);
+
+  if (new_book_path)
+    return run_book(num_workers, new_book_path,
+                    tournament_games > 0 ? tournament_games : -1);
+
+  if (replay_path) {
+    if (turn_log == NULL)
+      turn_log = stdout;
+    return run_replay(num_workers, replay_path, replay_index,
+                      replay_turn_index);
+  }
+
+  if (tournament_games > 0) {
+    run_tournament(num_workers, tournament_games, difficulty_idx);
+    return 0;
+  }
+
+  if (replay_index >= 0) {
+    /* a single worker, like in the tournament */
+    agent *a = agent_alloc(1, &game_rng);
+    int won = play_seeded_game(a, replay_index, difficulty,
+                               quiet ? NULL : stdout);
+    printf("game %d with %d piles: %s\n", replay_index, difficulty,
+           won ? "won" : "lost");
+    agent_free(a);
+    return 0;
+  }
+
+  agent *a = agent_alloc(num_workers, &game_rng);
+  game_state *game = state_alloc();
+  int games_won = 0;
+
+  /* number of games */
+  for (int g = 0; g < TOTAL_GAMES; ++g) {
+    random_init(game, &game_rng);
+    games_won += play_game(a, game, g, quiet ? NULL : stdout);
+
     printf("games won = %d / %d\n", games_won, g + 1);
   }
+
+  agent_free(a);
+  free(game);
 }
+
+#endif